@@ -8,19 +8,65 @@
 #include <clang/AST/TypeLoc.h>
 #include <clang/ASTMatchers/ASTMatchFinder.h>
 #include <clang/ASTMatchers/ASTMatchers.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/IdentifierTable.h>
+#include <clang/Basic/LangOptions.h>
+#include <clang/Basic/LangStandard.h>
 #include <clang/Basic/SourceLocation.h>
+#include <clang/Basic/SourceManager.h>
 #include <clang/Basic/TokenKinds.h>
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/HeaderSearchOptions.h>
 #include <clang/Lex/Lexer.h>
+#include <clang/Serialization/PCHContainerOperations.h>
 #include <clang/Tooling/ArgumentsAdjusters.h>
 #include <clang/Tooling/CommonOptionsParser.h>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/JSONCompilationDatabase.h>
 #include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/JSON.h>
-#include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/TargetParser/Triple.h>
 #pragma GCC diagnostic pop
 
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -37,6 +83,8 @@ struct Link {
   StringRef file;
   unsigned int line;
   unsigned int column;
+
+  bool operator==(const Link &) const = default;
 };
 
 struct ResultToken {
@@ -85,7 +133,7 @@ struct ResultToken {
     return "unknown";
   }
 
-  void determineType(const clang::Preprocessor &pp) {
+  void determineType(IdentifierTable &identifiers) {
     type = [&]() {
       if (token.isLiteral()) {
         switch (token.getKind()) {
@@ -101,7 +149,11 @@ struct ResultToken {
           return Type::OtherLiteral;
         }
       } else if (token.is(tok::raw_identifier)) {
-        pp.LookUpIdentifierInfo(token);
+        // Same as Preprocessor::LookUpIdentifierInfo(), but also works for
+        // the lexical fallback, where we do not have a preprocessor.
+        auto &info = identifiers.get(token.getRawIdentifier());
+        token.setIdentifierInfo(&info);
+        token.setKind(info.getTokenID());
 
         if (token.is(tok::identifier))
           return Type::Name;
@@ -118,6 +170,7 @@ struct ResultToken {
                const clang::LangOptions &langOpts) {
     auto declLoc = decl->getLocation();
 
+    linkedDecl = decl->getCanonicalDecl();
     link = Link{.name = decl->getNameAsString(),
                 .qualifiedName = decl->getQualifiedNameAsString(),
                 .file = sourceManager.getFilename(declLoc),
@@ -137,9 +190,9 @@ struct ResultToken {
 
   ResultToken() = default;
 
-  explicit ResultToken(const Token &token, const clang::Preprocessor &pp)
+  explicit ResultToken(const Token &token, IdentifierTable &identifiers)
       : token{token} {
-    determineType(pp);
+    determineType(identifiers);
   }
 
   explicit ResultToken(const Token &token, Type type)
@@ -148,6 +201,18 @@ struct ResultToken {
   Token token;
   Type type = Type::Other;
   std::optional<Link> link;
+
+  // Canonical declaration the link was generated from (if any)
+  const Decl *linkedDecl = nullptr;
+
+  // How the token was highlighted in configurations where it differs from
+  // the above (see --all-configs)
+  struct Variant {
+    std::size_t configuration;
+    Type type;
+    std::optional<Link> link;
+  };
+  std::vector<Variant> variants;
 };
 
 static const NamedDecl *unspecialize(const NamedDecl *decl) {
@@ -183,28 +248,47 @@ static const NamedDecl *unspecialize(const NamedDecl *decl) {
 
 class TokenMap : public std::map<std::size_t, ResultToken> {
 public:
-  auto lowerBound(std::size_t offset) {
-    return std::lower_bound(
-        begin(), end(), offset,
-        [](const auto &pair, std::size_t o) { return pair.first < o; });
-  }
-  auto lowerBound(std::size_t offset) const {
-    return std::lower_bound(
-        begin(), end(), offset,
-        [](const auto &pair, std::size_t o) { return pair.first < o; });
+  // Set if punctuation tokens were not inserted during lexing, since they
+  // will be filtered from the output anyway (see --punctuation).
+  bool punctuationDropped = false;
+
+  auto lowerBound(std::size_t offset) { return lower_bound(offset); }
+  auto lowerBound(std::size_t offset) const { return lower_bound(offset); }
+
+  // Lex & insert the punctuation token at loc, if we dropped it during
+  // lexing. This is needed for the few punctuation tokens that end up
+  // linked (e.g. overloaded operators) or part of preprocessor directives.
+  iterator relexDropped(SourceLocation loc, const SourceManager &sourceManager,
+                        const LangOptions &langOpts) {
+    if (!punctuationDropped)
+      return end();
+
+    Token tok;
+    if (Lexer::getRawToken(loc, tok, sourceManager, langOpts))
+      return end();
+
+    // Did we end up somewhere else, e.g. behind a comment?
+    if (tok.getLocation() != loc)
+      return end();
+
+    // Same classification as ResultToken::determineType()
+    if (tok.isLiteral() || tok.isOneOf(tok::raw_identifier, tok::comment))
+      return end();
+
+    auto [it, _] = emplace(sourceManager.getFileOffset(loc),
+                           ResultToken{tok, ResultToken::Type::Punctuation});
+    return it;
   }
 
   ResultToken *getOrSplitToken(std::size_t offset) {
-    auto it = lowerBound(offset);
-    if (it == end())
-      return {};
-
-    if (it->first > offset) {
-      // Are we inside the token before?
-      --it;
-      if (it == begin())
-        return {}; // Nothing there
-
+    // Last token starting at or before offset
+    auto it = upper_bound(offset);
+    if (it == begin())
+      return {}; // Nothing there
+    --it;
+
+    if (it->first < offset) {
+      // Are we inside that token?
       std::size_t origLength = it->second.token.getLength();
       bool inside = it->first <= offset && it->first + origLength > offset;
       if (!inside)
@@ -229,23 +313,231 @@ public:
       auto [itNew, _] = emplace(secondOffset, std::move(secondPart));
 
       return &itNew->second;
-    } else if (it->first == offset) {
-      return &it->second;
     } else
-      throw std::logic_error{"getOrSplitToken logic error"};
+      return &it->second;
+  }
+};
+
+// A token we expected to find in the main file, but did not
+struct Mismatch {
+  const char *kind;
+  std::size_t offset;
+  unsigned int line;
+  unsigned int column;
+
+  // Index of the configuration it was found in (see --all-configs)
+  std::optional<std::size_t> configuration;
+};
+
+// Collects mismatches. Unless we should keep going, the first mismatch is
+// fatal.
+struct MismatchLog {
+  bool fatal = true;
+  std::vector<Mismatch> mismatches;
+
+  void record(const char *kind, SourceLocation loc,
+              const SourceManager &sourceManager) {
+    mismatches.push_back(
+        Mismatch{.kind = kind,
+                 .offset = sourceManager.getFileOffset(loc),
+                 .line = sourceManager.getSpellingLineNumber(loc),
+                 .column = sourceManager.getSpellingColumnNumber(loc)});
+  }
+};
+
+#ifdef __linux__
+// Hardware performance counters of the thread that first enables them.
+// Opening the group takes several syscalls, so it is opened once and then only
+// enabled around each measured section; the counts accumulate while enabled.
+class PerfCounters {
+public:
+  static constexpr std::array<std::uint64_t, 4> COUNTERS{
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+  using Values = std::array<std::uint64_t, COUNTERS.size()>;
+
+  PerfCounters() = default;
+  ~PerfCounters() { close(); }
+
+  // Copies do not share the file descriptors and open their own group
+  PerfCounters(const PerfCounters &) {}
+  PerfCounters &operator=(const PerfCounters &) { return *this; }
+
+  void enable() {
+    if (!opened) {
+      opened = true;
+      open();
+    }
+    if (fds[0] >= 0)
+      ::ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  // Returns the totals of all enabled sections so far
+  std::optional<Values> disable() {
+    if (fds[0] < 0)
+      return std::nullopt;
+
+    ::ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    struct {
+      std::uint64_t count;
+      Values values;
+    } data;
+    if (::read(fds[0], &data, sizeof(data)) != sizeof(data) ||
+        data.count != COUNTERS.size()) {
+      close();
+      return std::nullopt;
+    }
+    return data.values;
+  }
+
+private:
+  void open() {
+    for (std::size_t i = 0; i < COUNTERS.size(); ++i) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = COUNTERS[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+
+      fds[i] = ::syscall(SYS_perf_event_open, &attr, 0, -1, fds[0],
+                         PERF_FLAG_FD_CLOEXEC);
+      if (fds[i] < 0) {
+        close();
+        return;
+      }
+    }
+  }
+
+  void close() {
+    for (int &fd : fds) {
+      if (fd >= 0)
+        ::close(fd);
+      fd = -1;
+    }
+  }
+
+  // Opening is only attempted once, even if it fails
+  bool opened = false;
+  std::array<int, COUNTERS.size()> fds{-1, -1, -1, -1};
+};
+#endif
+
+// Wall time and hardware performance counters of one processing phase
+struct PhaseStats {
+  unsigned int runs = 0;
+  double seconds = 0.0;
+
+  // Hardware counters are not available everywhere (e.g. in containers or
+  // with perf_event_paranoid > 2)
+  bool haveCounters = false;
+  std::uint64_t cycles = 0;
+  std::uint64_t instructions = 0;
+  std::uint64_t cacheMisses = 0;
+  std::uint64_t branchMisses = 0;
+
+#ifdef __linux__
+  PerfCounters counters;
+#endif
+};
+
+// Adds the time & counters of the current thread during its lifetime to a
+// PhaseStats instance (if not null)
+class PhaseTimer {
+public:
+  explicit PhaseTimer(PhaseStats *stats) : stats{stats} {
+    if (!stats)
+      return;
+
+#ifdef __linux__
+    stats->counters.enable();
+#endif
+    start = std::chrono::steady_clock::now();
+  }
+
+  ~PhaseTimer() {
+    if (!stats)
+      return;
+
+    auto end = std::chrono::steady_clock::now();
+#ifdef __linux__
+    if (auto values = stats->counters.disable()) {
+      stats->haveCounters = true;
+      stats->cycles = (*values)[0];
+      stats->instructions = (*values)[1];
+      stats->cacheMisses = (*values)[2];
+      stats->branchMisses = (*values)[3];
+    }
+#endif
+
+    stats->runs++;
+    stats->seconds += std::chrono::duration<double>(end - start).count();
+  }
+
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  PhaseStats *stats;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Counters reported with --stats
+struct Statistics {
+  // Visits of DeclRefExprs & MemberExprs in the main file
+  std::size_t linkVisits = 0;
+
+  // Visits that were skipped since an earlier instantiation of the same
+  // template already linked the token to the same declaration
+  std::size_t elidedInstantiationVisits = 0;
+
+  // Phases are only measured if requested
+  bool measurePhases = false;
+  PhaseStats parsing;
+  PhaseStats lexing;
+  PhaseStats preprocessor;
+  PhaseStats matching;
+
+  PhaseStats *measure(PhaseStats &phase) {
+    return measurePhases ? &phase : nullptr;
   }
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 // Semantic AST matchers
 
+// Templates are matched once per instantiation. Check whether an earlier
+// instantiation already linked the token at offset to decl, in which case
+// there is nothing left to do for this one.
+static bool linkedByInstantiation(const TokenMap &tokens, std::size_t offset,
+                                  const NamedDecl *decl, const Stmt &node,
+                                  ASTContext &context) {
+  auto it = tokens.find(offset);
+  if (it == tokens.end() || !it->second.linkedDecl)
+    return false;
+
+  auto linked = it->second.linkedDecl;
+  if (linked != decl->getCanonicalDecl() &&
+      linked != unspecialize(decl)->getCanonicalDecl())
+    return false;
+
+  // Macros expanded several times also visit the same token repeatedly
+  return !match(stmt(isInTemplateInstantiation()), node, context).empty();
+}
+
 // Find references to declarations in expressions and link them
 StatementMatcher DeclRefMatcher =
     declRefExpr(isExpansionInMainFile()).bind("declRefExpr");
 
 class DeclRefExprHandler : public MatchFinder::MatchCallback {
 public:
-  explicit DeclRefExprHandler(TokenMap &tokens) : tokens{tokens} {}
+  explicit DeclRefExprHandler(TokenMap &tokens, MismatchLog &log,
+                              Statistics &stats)
+      : tokens{tokens}, log{log}, stats{stats} {}
 
   virtual void run(const MatchFinder::MatchResult &Result) {
     if (const auto *DRE =
@@ -261,14 +553,32 @@ public:
       if (!decl)
         return;
 
+      auto offset = sourceManager.getFileOffset(loc);
+      if (linkedByInstantiation(tokens, offset, decl, *DRE, *Result.Context)) {
+        stats.linkVisits++;
+        stats.elidedInstantiationVisits++;
+        return;
+      }
+
       decl = unspecialize(decl);
 
-      auto offset = sourceManager.getFileOffset(loc);
-      if (ResultToken *res = tokens.getOrSplitToken(offset)) {
+      ResultToken *res = tokens.getOrSplitToken(offset);
+      if (!res) {
+        auto it = tokens.relexDropped(loc, sourceManager,
+                                      Result.Context->getLangOpts());
+        if (it != tokens.end())
+          res = &it->second;
+      }
+
+      if (res) {
+        stats.linkVisits++;
+
         if (dyn_cast<VarDecl>(decl))
           res->type = ResultToken::Type::Variable;
 
         res->addLink(decl, sourceManager, Result.Context->getLangOpts());
+      } else if (!log.fatal) {
+        log.record("DeclRefExpr", loc, sourceManager);
       } else {
         std::cerr << "Looking for offset " << offset << "\n";
         DRE->dump();
@@ -280,6 +590,8 @@ public:
 
 private:
   TokenMap &tokens;
+  MismatchLog &log;
+  Statistics &stats;
 };
 
 // Find variable declarations and mark the tokens as variable names
@@ -289,7 +601,8 @@ DeclarationMatcher VarDeclMatcher =
 
 class VarDeclHandler : public MatchFinder::MatchCallback {
 public:
-  explicit VarDeclHandler(TokenMap &tokens) : tokens{tokens} {}
+  explicit VarDeclHandler(TokenMap &tokens, MismatchLog &log)
+      : tokens{tokens}, log{log} {}
 
   virtual void run(const MatchFinder::MatchResult &Result) {
     if (const auto *VD = Result.Nodes.getNodeAs<clang::VarDecl>("varDecl")) {
@@ -300,10 +613,24 @@ public:
       if (!loc.isValid() || !sourceManager.isWrittenInMainFile(loc))
         return;
 
+      // Structured bindings (DecompositionDecl) and unnamed parameters are
+      // located at a punctuation token, not at a name
+      if (!VD->getIdentifier())
+        return;
+
       auto offset = sourceManager.getFileOffset(loc);
 
       auto it = tokens.lowerBound(offset);
-      if (it == tokens.end() || it->first != offset) {
+      if (it == tokens.end() || it->first != offset)
+        it = tokens.relexDropped(loc, sourceManager,
+                                 Result.Context->getLangOpts());
+
+      if (it == tokens.end()) {
+        if (!log.fatal) {
+          log.record("VarDecl", loc, sourceManager);
+          return;
+        }
+
         std::cerr << "Looking for offset " << offset << "\n";
         loc.dump(sourceManager);
         VD->dump();
@@ -316,6 +643,7 @@ public:
 
 private:
   TokenMap &tokens;
+  MismatchLog &log;
 };
 
 // Find types and link them to their declarations
@@ -358,6 +686,7 @@ private:
 
     SourceLocation toLoc = decl->getLocation();
 
+    it->second.linkedDecl = nullptr;
     it->second.link =
         Link{.name = decl->getNameAsString(),
              .qualifiedName = decl->getQualifiedNameAsString(),
@@ -402,7 +731,9 @@ StatementMatcher MemberExprMatcher =
 
 class MemberExprHandler : public MatchFinder::MatchCallback {
 public:
-  explicit MemberExprHandler(TokenMap &tokens) : tokens{tokens} {}
+  explicit MemberExprHandler(TokenMap &tokens, MismatchLog &log,
+                             Statistics &stats)
+      : tokens{tokens}, log{log}, stats{stats} {}
 
   virtual void run(const MatchFinder::MatchResult &Result) {
     if (const MemberExpr *ME =
@@ -415,64 +746,162 @@ public:
         return;
       auto offset = sourceManager.getFileOffset(loc);
 
+      const NamedDecl *decl = ME->getMemberDecl();
+      if (decl &&
+          linkedByInstantiation(tokens, offset, decl, *ME, *Result.Context)) {
+        stats.linkVisits++;
+        stats.elidedInstantiationVisits++;
+        return;
+      }
+
       auto it = tokens.lowerBound(offset);
       if (it == tokens.end() || it->first != offset)
+        it = tokens.relexDropped(loc, sourceManager,
+                                 Result.Context->getLangOpts());
+
+      if (it == tokens.end()) {
+        if (!log.fatal) {
+          log.record("MemberExpr", loc, sourceManager);
+          return;
+        }
+
         throw std::runtime_error{"Could not find MemberExpr token"};
+      }
 
-      const NamedDecl *decl = ME->getMemberDecl();
       if (!decl)
         return;
 
       decl = unspecialize(decl);
 
+      stats.linkVisits++;
       it->second.addLink(decl, sourceManager, Result.Context->getLangOpts());
     }
   }
 
 private:
   TokenMap &tokens;
+  MismatchLog &log;
+  Statistics &stats;
 };
 
 enum class PunctuationMode { Keep, KeepLinked, Skip };
 
-void dumpJSON(std::ostream &out, const std::string &file,
-              const TokenMap &tokens,
-              PunctuationMode punct = PunctuationMode::Keep) {
+enum class OutputFormat { JSON, Compact };
+
+enum class Compression { None, Zlib };
+
+// Highlighting information for the main file of one translation unit
+struct HighlightResult {
+  std::string file;
+  TokenMap tokens;
+
+  // Source path as given on the command line, so that batch results can be
+  // matched to their inputs. Empty outside of batch mode.
+  std::string input;
+
+  // Set if we only have the raw lexer output (see --deadline-ms)
+  bool degraded = false;
+
+  MismatchLog mismatches;
+  Statistics stats;
+
+  // Command line of each configuration, if there are several (see
+  // --all-configs)
+  std::vector<std::string> configurations;
+
+  // The source manager owns the file names referenced by our links
+  std::unique_ptr<ASTUnit> ast;
+
+  // Same for links taken from the other configurations
+  std::vector<std::unique_ptr<ASTUnit>> otherASTs;
+};
+
+static bool isFiltered(const ResultToken &token, PunctuationMode punct) {
+  if (token.type != ResultToken::Type::Punctuation)
+    return false;
+
+  return punct == PunctuationMode::Skip ||
+         (punct == PunctuationMode::KeepLinked && !token.link);
+}
+
+void dumpJSON(llvm::raw_ostream &out, const HighlightResult &result,
+              PunctuationMode punct = PunctuationMode::Keep,
+              bool withStats = false, unsigned int indent = 2) {
   {
-    llvm::raw_os_ostream osOStream{out};
-    llvm::json::OStream stream{osOStream, 2};
+    llvm::json::OStream stream{out, indent};
+
+    auto dumpLink = [&](const Link &link) {
+      stream.attributeObject("link", [&]() {
+        stream.attribute("file", link.file);
+        stream.attribute("line", link.line);
+        stream.attribute("column", link.column);
+        stream.attribute("name", link.name);
+        stream.attribute("qualified_name", link.qualifiedName);
+
+        if constexpr (LINK_DUMP)
+          stream.attribute("dump", link.dump);
+
+        if (!link.parameterTypes.empty()) {
+          stream.attributeArray("parameter_types", [&]() {
+            for (auto &param : link.parameterTypes)
+              stream.value(param);
+          });
+        }
+      });
+    };
 
     stream.object([&]() {
-      stream.attribute("file", file);
-      stream.attributeArray("tokens", [&]() {
-        for (const auto &[offset, token] : tokens) {
-          if (token.type == ResultToken::Type::Punctuation) {
-            if (punct == PunctuationMode::KeepLinked && !token.link)
-              continue;
-            if (punct == PunctuationMode::Skip)
-              continue;
+      stream.attribute("file", result.file);
+      if (!result.input.empty())
+        stream.attribute("input", result.input);
+      if (result.degraded)
+        stream.attribute("degraded", true);
+      if (!result.configurations.empty()) {
+        stream.attributeArray("configurations", [&]() {
+          for (const auto &configuration : result.configurations)
+            stream.value(configuration);
+        });
+      }
+      if (!result.mismatches.mismatches.empty()) {
+        stream.attributeArray("mismatches", [&]() {
+          for (const auto &mismatch : result.mismatches.mismatches) {
+            stream.object([&]() {
+              stream.attribute("kind", mismatch.kind);
+              stream.attribute("offset", mismatch.offset);
+              stream.attribute("line", mismatch.line);
+              stream.attribute("column", mismatch.column);
+              if (mismatch.configuration)
+                stream.attribute("configuration", *mismatch.configuration);
+            });
           }
+        });
+      }
+      // Measured here, so that we can include it in the output
+      PhaseStats serialization;
+      stream.attributeArray("tokens", [&]() {
+        PhaseTimer timer{withStats ? &serialization : nullptr};
+
+        for (const auto &[offset, token] : result.tokens) {
+          if (isFiltered(token, punct))
+            continue;
 
           stream.object([&]() {
             stream.attribute("offset", offset);
             stream.attribute("length", token.token.getLength());
             stream.attribute("type", ResultToken::typeName(token.type));
 
-            if (token.link) {
-              stream.attributeObject("link", [&]() {
-                stream.attribute("file", token.link->file);
-                stream.attribute("line", token.link->line);
-                stream.attribute("column", token.link->column);
-                stream.attribute("name", token.link->name);
-                stream.attribute("qualified_name", token.link->qualifiedName);
-
-                if constexpr (LINK_DUMP)
-                  stream.attribute("dump", token.link->dump);
-
-                if (!token.link->parameterTypes.empty()) {
-                  stream.attributeArray("parameter_types", [&]() {
-                    for (auto &param : token.link->parameterTypes)
-                      stream.value(param);
+            if (token.link)
+              dumpLink(*token.link);
+
+            if (!token.variants.empty()) {
+              stream.attributeArray("variants", [&]() {
+                for (const auto &variant : token.variants) {
+                  stream.object([&]() {
+                    stream.attribute("configuration", variant.configuration);
+                    stream.attribute("type",
+                                     ResultToken::typeName(variant.type));
+                    if (variant.link)
+                      dumpLink(*variant.link);
                   });
                 }
               });
@@ -480,87 +909,380 @@ void dumpJSON(std::ostream &out, const std::string &file,
           });
         }
       });
+
+      if (withStats) {
+        stream.attributeObject("stats", [&]() {
+          std::size_t links = 0;
+          for (const auto &[offset, token] : result.tokens) {
+            if (token.link)
+              links++;
+          }
+
+          stream.attribute("tokens", result.tokens.size());
+          stream.attribute("links", links);
+          stream.attribute("link_visits", result.stats.linkVisits);
+          stream.attribute("elided_instantiation_visits",
+                           result.stats.elidedInstantiationVisits);
+
+          stream.attributeObject("phases", [&]() {
+            auto dumpPhase = [&](const char *name, const PhaseStats &phase) {
+              if (phase.runs == 0)
+                return;
+
+              stream.attributeObject(name, [&]() {
+                stream.attribute("seconds", phase.seconds);
+                if (phase.haveCounters) {
+                  stream.attribute("cycles", phase.cycles);
+                  stream.attribute("instructions", phase.instructions);
+                  stream.attribute("cache_misses", phase.cacheMisses);
+                  stream.attribute("branch_misses", phase.branchMisses);
+                }
+              });
+            };
+
+            dumpPhase("parsing", result.stats.parsing);
+            dumpPhase("lexing", result.stats.lexing);
+            dumpPhase("preprocessor", result.stats.preprocessor);
+            dumpPhase("matching", result.stats.matching);
+            dumpPhase("serialization", serialization);
+          });
+        });
+      }
     });
   }
   out << "\n";
 }
 
-// Apply a custom category to all command-line options so that they are the
-// only ones displayed.
-static llvm::cl::OptionCategory MyCategory("clang_highlight options");
+static constexpr StringRef COMPACT_MAGIC{"CHTK\x01", 5};
 
-// CommonOptionsParser declares HelpMessage with a description of the common
-// command-line options related to the compilation database and input files.
-// It's nice to have this help message in all tools.
-static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
+static void writeVarint(std::string &out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
 
-static cl::opt<PunctuationMode> OptPunctMode{
-    "punctuation", cl::desc{"Choose which punctuation tokens to keep"},
-    cl::values(
-        clEnumValN(PunctuationMode::Keep, "keep",
-                   "Keep all punctuation (default)"),
-        clEnumValN(
-            PunctuationMode::KeepLinked, "linked",
-            "Keep only punctuation tokens with links (e.g. custom operators)"),
-        clEnumValN(PunctuationMode::Skip, "skip", "Skip all punctuation")),
-    cl::init(PunctuationMode::Keep), cl::cat(MyCategory)};
+static void writeString(std::string &out, StringRef str) {
+  writeVarint(out, str.size());
+  out.append(str.data(), str.size());
+}
 
-// // A help message for this specific tool can be added afterwards.
-// static cl::extrahelp MoreHelp("\nMore help text...\n");
+// Compact binary encoding (--format=compact), which is about an order of
+// magnitude smaller than the JSON output. All integers are LEB128 varints,
+// strings are stored as their size followed by the bytes.
+//
+//   "CHTK", version (1 byte)
+//   Flags (bit 0: degraded), file
+//   String table: count, strings
+//   Link table: count, {file, line, column, name, qualified name,
+//                       number of parameter types, parameter types...}
+//   Mismatches: count, {kind, offset, line, column}
+//   Tokens: count, {offset delta, length << 5 | type << 1 | has link,
+//                   link index (if any)}
+//
+// Strings in links and mismatches refer to the string table. Token offsets
+// are relative to the end of the previous token (zigzag-encoded, in case
+// tokens overlap). Statistics are not included.
+void dumpCompact(llvm::raw_ostream &out, const HighlightResult &result,
+                 PunctuationMode punct = PunctuationMode::Keep) {
+  std::vector<StringRef> strings;
+  llvm::StringMap<std::uint32_t> stringIndices;
+  auto intern = [&](StringRef str) -> std::uint32_t {
+    auto [it, inserted] = stringIndices.try_emplace(str, strings.size());
+    if (inserted)
+      strings.push_back(it->getKey());
+    return it->second;
+  };
 
-int main(int argc, const char **argv) {
-  cl::SetVersionPrinter([&](llvm::raw_ostream &stream) {
-    stream << "clang-highlight version " << CH_VERSION_MAJOR << "."
-           << CH_VERSION_MINOR << "." << CH_VERSION_PATCH << "\n";
-  });
+  // Many tokens link to the same declaration, so links are deduplicated by
+  // their encoding.
+  std::string links;
+  llvm::StringMap<std::uint32_t> linkIndices;
+
+  std::string tokens;
+  std::size_t tokenCount = 0;
+  std::size_t previousEnd = 0;
+  for (const auto &[offset, token] : result.tokens) {
+    if (isFiltered(token, punct))
+      continue;
+
+    auto delta = static_cast<std::int64_t>(offset) -
+                 static_cast<std::int64_t>(previousEnd);
+    std::uint64_t length = token.token.getLength();
+    writeVarint(tokens, (static_cast<std::uint64_t>(delta) << 1) ^
+                            static_cast<std::uint64_t>(delta >> 63));
+    writeVarint(tokens, length << 5 |
+                            static_cast<std::uint64_t>(token.type) << 1 |
+                            (token.link ? 1 : 0));
+
+    if (token.link) {
+      const auto &link = *token.link;
+
+      std::string encoded;
+      writeVarint(encoded, intern(link.file));
+      writeVarint(encoded, link.line);
+      writeVarint(encoded, link.column);
+      writeVarint(encoded, intern(link.name));
+      writeVarint(encoded, intern(link.qualifiedName));
+      writeVarint(encoded, link.parameterTypes.size());
+      for (const auto &param : link.parameterTypes)
+        writeVarint(encoded, intern(param));
+
+      auto [it, inserted] =
+          linkIndices.try_emplace(encoded, linkIndices.size());
+      if (inserted)
+        links += encoded;
+      writeVarint(tokens, it->second);
+    }
 
-  auto ExpectedParser = CommonOptionsParser::create(
-      argc, argv, MyCategory, cl::NumOccurrencesFlag::Required);
-  if (!ExpectedParser) {
-    // Fail gracefully for unsupported options.
-    llvm::errs() << ExpectedParser.takeError();
-    return 1;
+    previousEnd = offset + length;
+    tokenCount++;
   }
-  CommonOptionsParser &OptionsParser = ExpectedParser.get();
-  ClangTool Tool(OptionsParser.getCompilations(),
-                 OptionsParser.getSourcePathList());
 
-  // We need information about preprocessor operation to highlight
-  // preprocessor directives and macro instantiations properly
-  Tool.appendArgumentsAdjuster(
-      getInsertArgumentAdjuster({"-Xclang", "-detailed-preprocessing-record"},
-                                ArgumentInsertPosition::END));
+  std::string mismatches;
+  for (const auto &mismatch : result.mismatches.mismatches) {
+    writeVarint(mismatches, intern(mismatch.kind));
+    writeVarint(mismatches, mismatch.offset);
+    writeVarint(mismatches, mismatch.line);
+    writeVarint(mismatches, mismatch.column);
+  }
 
-  // Load additional clang flags from our config directory
-  Tool.appendArgumentsAdjuster(
-      getInsertArgumentAdjuster({"--config-user-dir=~/.config/clang-highlight",
-                                 "--config-system-dir=/etc/clang-highlight"},
-                                ArgumentInsertPosition::BEGIN));
+  std::string header = COMPACT_MAGIC.str();
+  writeVarint(header, result.degraded ? 1 : 0);
+  writeString(header, result.file);
+  writeVarint(header, strings.size());
+  for (auto str : strings)
+    writeString(header, str);
+
+  out << header;
+  std::string count;
+  writeVarint(count, linkIndices.size());
+  out << count << links;
+
+  count.clear();
+  writeVarint(count, result.mismatches.mismatches.size());
+  out << count << mismatches;
+
+  count.clear();
+  writeVarint(count, tokenCount);
+  out << count << tokens;
+}
 
-  std::vector<std::unique_ptr<ASTUnit>> ASTs;
-  if (auto ret = Tool.buildASTs(ASTs))
-    return ret;
-
-  auto &ast = ASTs.front();
-  auto &sourceManager = ast->getSourceManager();
-
-  // Lexing
-  StringRef buffer = [&]() {
-    bool invalid = false;
-    buffer =
-        sourceManager.getBufferData(sourceManager.getMainFileID(), &invalid);
-    if (invalid) {
-      std::cerr << "Could not get source text\n";
-      std::exit(1);
-    }
-
-    return buffer;
-  }();
-  Lexer lexer(sourceManager.getLocForStartOfFile(sourceManager.getMainFileID()),
-              ast->getLangOpts(), buffer.begin(), buffer.data(), buffer.end());
-  lexer.SetCommentRetentionState(true);
+// A result read back from the compact encoding. Strings refer to the encoded
+// data, so it has to outlive this.
+struct CompactResult {
+  struct Token {
+    std::size_t offset;
+    std::size_t length;
+    ResultToken::Type type;
+    std::optional<std::size_t> link;
+  };
 
-  TokenMap tokens;
+  struct Mismatch {
+    StringRef kind;
+    std::size_t offset;
+    unsigned int line;
+    unsigned int column;
+  };
+
+  StringRef file;
+  bool degraded = false;
+  std::vector<Link> links;
+  std::vector<Mismatch> mismatches;
+  std::vector<Token> tokens;
+};
+
+// Inverse of dumpCompact() (--decode-compact). Throws std::runtime_error for
+// malformed data.
+CompactResult readCompact(StringRef data) {
+  if (!data.starts_with(COMPACT_MAGIC))
+    throw std::runtime_error{"not a compact clang-highlight result"};
+
+  std::size_t pos = COMPACT_MAGIC.size();
+  auto varint = [&]() {
+    std::uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (pos >= data.size())
+        throw std::runtime_error{"truncated compact result"};
+
+      auto byte = static_cast<std::uint8_t>(data[pos++]);
+      value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+      if (byte < 0x80)
+        return value;
+    }
+    throw std::runtime_error{"invalid varint in compact result"};
+  };
+  auto string = [&]() {
+    std::uint64_t size = varint();
+    if (size > data.size() - pos)
+      throw std::runtime_error{"truncated compact result"};
+
+    StringRef str = data.substr(pos, size);
+    pos += size;
+    return str;
+  };
+  // Index into a table with the given number of entries
+  auto index = [&](std::size_t count) {
+    std::uint64_t value = varint();
+    if (value >= count)
+      throw std::runtime_error{"invalid index in compact result"};
+    return static_cast<std::size_t>(value);
+  };
+  // Size of a table, each entry of which takes at least one byte
+  auto count = [&]() {
+    std::uint64_t value = varint();
+    if (value > data.size() - pos)
+      throw std::runtime_error{"truncated compact result"};
+    return static_cast<std::size_t>(value);
+  };
+
+  CompactResult result;
+  result.degraded = varint() & 1;
+  result.file = string();
+
+  std::vector<StringRef> strings(count());
+  for (auto &str : strings)
+    str = string();
+
+  result.links.resize(count());
+  for (auto &link : result.links) {
+    link.file = strings[index(strings.size())];
+    link.line = varint();
+    link.column = varint();
+    link.name = strings[index(strings.size())].str();
+    link.qualifiedName = strings[index(strings.size())].str();
+    link.parameterTypes.resize(count());
+    for (auto &param : link.parameterTypes)
+      param = strings[index(strings.size())].str();
+  }
+
+  result.mismatches.resize(count());
+  for (auto &mismatch : result.mismatches) {
+    mismatch.kind = strings[index(strings.size())];
+    mismatch.offset = varint();
+    mismatch.line = varint();
+    mismatch.column = varint();
+  }
+
+  std::size_t previousEnd = 0;
+  result.tokens.resize(count());
+  for (auto &token : result.tokens) {
+    std::uint64_t delta = varint();
+    std::uint64_t packed = varint();
+
+    token.offset = previousEnd + ((delta >> 1) ^ -(delta & 1));
+    token.length = packed >> 5;
+
+    auto type = (packed >> 1) & 0xF;
+    if (type > static_cast<std::uint64_t>(ResultToken::Type::Other))
+      throw std::runtime_error{"invalid token type in compact result"};
+    token.type = static_cast<ResultToken::Type>(type);
+
+    if (packed & 1)
+      token.link = index(result.links.size());
+
+    previousEnd = token.offset + token.length;
+  }
+
+  if (pos != data.size())
+    throw std::runtime_error{"trailing data after compact result"};
+
+  return result;
+}
+
+// Same layout as the JSON output of the original result (without statistics)
+void dumpJSON(llvm::raw_ostream &out, const CompactResult &result,
+              unsigned int indent = 2) {
+  {
+    llvm::json::OStream stream{out, indent};
+
+    stream.object([&]() {
+      stream.attribute("file", result.file);
+      if (result.degraded)
+        stream.attribute("degraded", true);
+      if (!result.mismatches.empty()) {
+        stream.attributeArray("mismatches", [&]() {
+          for (const auto &mismatch : result.mismatches) {
+            stream.object([&]() {
+              stream.attribute("kind", mismatch.kind);
+              stream.attribute("offset", mismatch.offset);
+              stream.attribute("line", mismatch.line);
+              stream.attribute("column", mismatch.column);
+            });
+          }
+        });
+      }
+      stream.attributeArray("tokens", [&]() {
+        for (const auto &token : result.tokens) {
+          stream.object([&]() {
+            stream.attribute("offset", token.offset);
+            stream.attribute("length", token.length);
+            stream.attribute("type", ResultToken::typeName(token.type));
+
+            if (!token.link)
+              return;
+
+            const auto &link = result.links[*token.link];
+            stream.attributeObject("link", [&]() {
+              stream.attribute("file", link.file);
+              stream.attribute("line", link.line);
+              stream.attribute("column", link.column);
+              stream.attribute("name", link.name);
+              stream.attribute("qualified_name", link.qualifiedName);
+
+              if (!link.parameterTypes.empty()) {
+                stream.attributeArray("parameter_types", [&]() {
+                  for (auto &param : link.parameterTypes)
+                    stream.value(param);
+                });
+              }
+            });
+          });
+        }
+      });
+    });
+  }
+  out << "\n";
+}
+
+// Result for a file we could not highlight (batch mode)
+void dumpError(llvm::raw_ostream &out, StringRef file, StringRef message) {
+  {
+    llvm::json::OStream stream{out};
+
+    stream.object([&]() {
+      stream.attribute("file", file);
+      stream.attribute("input", file);
+      stream.attribute("error", message);
+    });
+  }
+  out << "\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Highlighting passes
+
+// Split the main file into raw tokens
+static bool lexMainFile(TokenMap &tokens, const SourceManager &sourceManager,
+                        const LangOptions &langOpts,
+                        IdentifierTable &identifiers, PunctuationMode punct) {
+  // If punctuation is filtered from the output, we do not even insert it.
+  // The few tokens that are needed later are lexed again on demand.
+  tokens.punctuationDropped = punct != PunctuationMode::Keep;
+
+  auto mainFile = sourceManager.getMainFileID();
+
+  bool invalid = false;
+  StringRef buffer = sourceManager.getBufferData(mainFile, &invalid);
+  if (invalid) {
+    std::cerr << "Could not get source text\n";
+    return false;
+  }
+
+  Lexer lexer(sourceManager.getLocForStartOfFile(mainFile), langOpts,
+              buffer.begin(), buffer.data(), buffer.end());
+  lexer.SetCommentRetentionState(true);
 
   Token tok;
   do {
@@ -568,109 +1290,1609 @@ int main(int argc, const char **argv) {
     if (tok.is(tok::eof))
       break;
 
-    ResultToken res{tok, ast->getPreprocessor()};
+    ResultToken res{tok, identifiers};
+    if (tokens.punctuationDropped && res.type == ResultToken::Type::Punctuation)
+      continue;
 
-    tokens[sourceManager.getFileOffset(tok.getLocation())] = res;
+    tokens.emplace_hint(tokens.end(),
+                        sourceManager.getFileOffset(tok.getLocation()), res);
   } while (lexer.getBufferLocation() < buffer.end());
 
-  // Handle preprocessor statements
-  {
-    auto &rec = *ast->getPreprocessor().getPreprocessingRecord();
-    auto prepBegin = rec.local_begin();
-    auto prepEnd = rec.local_end();
-
-    for (auto it = prepBegin; it != prepEnd; ++it) {
-      auto preproc = *it;
-      auto beginLoc = preproc->getSourceRange().getBegin();
-      if (!sourceManager.isWrittenInMainFile(beginLoc) ||
-          ast->isInPreambleFileID(beginLoc) ||
-          !rec.isEntityInFileID(it, sourceManager.getMainFileID()))
-        continue;
-
-      auto beginOffset =
-          sourceManager.getFileOffset(preproc->getSourceRange().getBegin());
-      auto tokenIt = tokens.lowerBound(beginOffset);
+  return true;
+}
 
-      if (tokenIt == tokens.end() || tokenIt->first != beginOffset) {
-        std::cerr << "WARNING: Could not find token for offset " << beginOffset
-                  << "\n";
-        preproc->getSourceRange().dump(sourceManager);
+// Handle preprocessor statements
+static void annotatePreprocessor(TokenMap &tokens, MismatchLog &log,
+                                 Preprocessor &pp,
+                                 const LangOptions &langOpts) {
+  if (!pp.getPreprocessingRecord())
+    return;
+
+  auto &sourceManager = pp.getSourceManager();
+  auto &rec = *pp.getPreprocessingRecord();
+
+  // This includes entities loaded from a saved AST (see --load-ast)
+  auto prepBegin = rec.begin();
+  auto prepEnd = rec.end();
+
+  auto preambleFile = sourceManager.getPreambleFileID();
+
+  for (auto it = prepBegin; it != prepEnd; ++it) {
+    auto preproc = *it;
+    auto beginLoc = preproc->getSourceRange().getBegin();
+    if (!sourceManager.isWrittenInMainFile(beginLoc) ||
+        (preambleFile.isValid() &&
+         sourceManager.isInFileID(beginLoc, preambleFile)) ||
+        !rec.isEntityInFileID(it, sourceManager.getMainFileID()))
+      continue;
+
+    auto beginOffset =
+        sourceManager.getFileOffset(preproc->getSourceRange().getBegin());
+    auto tokenIt = tokens.lowerBound(beginOffset);
+    if (tokenIt == tokens.end() || tokenIt->first != beginOffset)
+      tokenIt = tokens.relexDropped(beginLoc, sourceManager, langOpts);
+
+    if (tokenIt == tokens.end()) {
+      if (!log.fatal) {
+        log.record("PreprocessedEntity", beginLoc, sourceManager);
         continue;
       }
 
-      switch (preproc->getKind()) {
-      case PreprocessedEntity::EntityKind::InclusionDirectiveKind: {
-        // Mark entire range as preprocessor
-        auto end = clang::Lexer::getLocForEndOfToken(
-            preproc->getSourceRange().getEnd(), 0, sourceManager,
-            ast->getLangOpts());
-        auto endOffset = sourceManager.getFileOffset(end);
+      std::cerr << "WARNING: Could not find token for offset " << beginOffset
+                << "\n";
+      preproc->getSourceRange().dump(sourceManager);
+      continue;
+    }
 
-        clang::Token lexerToken = tokenIt->second.token;
-        lexerToken.setLength(endOffset - beginOffset);
+    switch (preproc->getKind()) {
+    case PreprocessedEntity::EntityKind::InclusionDirectiveKind: {
+      // Mark entire range as preprocessor
+      auto end = clang::Lexer::getLocForEndOfToken(
+          preproc->getSourceRange().getEnd(), 0, sourceManager, langOpts);
+      auto endOffset = sourceManager.getFileOffset(end);
 
-        while (tokenIt != tokens.end()) {
-          if (tokenIt->first > endOffset)
-            break;
+      clang::Token lexerToken = tokenIt->second.token;
+      lexerToken.setLength(endOffset - beginOffset);
 
-          tokenIt = tokens.erase(tokenIt);
-        }
+      while (tokenIt != tokens.end()) {
+        if (tokenIt->first > endOffset)
+          break;
 
-        auto token = ResultToken{lexerToken, ResultToken::Type::Preprocessor};
+        tokenIt = tokens.erase(tokenIt);
+      }
 
-        auto include = static_cast<clang::InclusionDirective *>(preproc);
-        if (auto file = include->getFile()) {
-          token.link = Link{.name = "<file>",
-                            .qualifiedName = "<file>",
-                            .file = file->getName(),
-                            .column = 0};
-        }
+      auto token = ResultToken{lexerToken, ResultToken::Type::Preprocessor};
 
-        tokens[beginOffset] = token;
-        break;
+      auto include = static_cast<clang::InclusionDirective *>(preproc);
+      if (auto file = include->getFile()) {
+        token.link = Link{.name = "<file>",
+                          .qualifiedName = "<file>",
+                          .file = file->getName(),
+                          .column = 0};
       }
-      case PreprocessedEntity::EntityKind::MacroExpansionKind:
-        // Mark only first token as preprocessor
-        tokenIt->second.type = ResultToken::Type::Preprocessor;
-
-        if (MacroExpansion *expansion = dyn_cast<MacroExpansion>(preproc)) {
-          if (auto def = expansion->getDefinition()) {
-            auto loc = def->getLocation();
-            auto file = sourceManager.getFilename(loc);
-
-            if (!sourceManager.isWrittenInMainFile(loc) && !file.empty()) {
-              tokenIt->second.link =
-                  Link{.name = def->getName()->getName().str(),
-                       .qualifiedName = def->getName()->getName().str(),
-                       .file = file,
-                       .line = sourceManager.getSpellingLineNumber(loc),
-                       .column = sourceManager.getSpellingColumnNumber(loc)};
-            }
+
+      tokens[beginOffset] = token;
+      break;
+    }
+    case PreprocessedEntity::EntityKind::MacroExpansionKind:
+      // Mark only first token as preprocessor
+      tokenIt->second.type = ResultToken::Type::Preprocessor;
+
+      if (MacroExpansion *expansion = dyn_cast<MacroExpansion>(preproc)) {
+        if (auto def = expansion->getDefinition()) {
+          auto loc = def->getLocation();
+          auto file = sourceManager.getFilename(loc);
+
+          if (!sourceManager.isWrittenInMainFile(loc) && !file.empty()) {
+            tokenIt->second.linkedDecl = nullptr;
+            tokenIt->second.link =
+                Link{.name = def->getName()->getName().str(),
+                     .qualifiedName = def->getName()->getName().str(),
+                     .file = file,
+                     .line = sourceManager.getSpellingLineNumber(loc),
+                     .column = sourceManager.getSpellingColumnNumber(loc)};
           }
         }
-
-        break;
-      default:
-        break;
       }
+
+      break;
+    default:
+      break;
     }
   }
+}
 
-  // Semantic AST pass
-  DeclRefExprHandler declRefHandler{tokens};
-  VarDeclHandler varDeclHandler{tokens};
+// Semantic AST pass
+static void annotateSemantics(TokenMap &tokens, MismatchLog &log,
+                              Statistics &stats, ASTContext &context) {
+  DeclRefExprHandler declRefHandler{tokens, log, stats};
+  VarDeclHandler varDeclHandler{tokens, log};
   TypeHandler typeHandler{tokens};
-  MemberExprHandler memberHandler{tokens};
+  MemberExprHandler memberHandler{tokens, log, stats};
   MatchFinder Finder;
   Finder.addMatcher(DeclRefMatcher, &declRefHandler);
   Finder.addMatcher(VarDeclMatcher, &varDeclHandler);
   Finder.addMatcher(::TypeMatcher, &typeHandler);
   Finder.addMatcher(MemberExprMatcher, &memberHandler);
-  Finder.matchAST(ast->getASTContext());
+  Finder.matchAST(context);
+}
 
-  // Dump JSON
-  auto file = ast->getMainFileName().str();
-  dumpJSON(std::cout, file, tokens, OptPunctMode);
+// Reuse the tokens lexed for another configuration of the same file. Only
+// their locations depend on the source manager.
+static void rebaseTokens(TokenMap &tokens, const TokenMap &lexed,
+                         const SourceManager &sourceManager) {
+  tokens = lexed;
 
-  return 0;
+  auto start =
+      sourceManager.getLocForStartOfFile(sourceManager.getMainFileID());
+  for (auto &[offset, token] : tokens)
+    token.token.setLocation(start.getLocWithOffset(offset));
+}
+
+// Full highlighting of the main file of result.ast. If given, the main file
+// is not lexed again, but the lexed tokens are reused.
+static bool highlightAST(HighlightResult &result, PunctuationMode punct,
+                         const TokenMap *lexed = nullptr) {
+  auto &ast = *result.ast;
+
+  auto &stats = result.stats;
+
+  result.file = ast.getMainFileName().str();
+
+  {
+    PhaseTimer timer{stats.measure(stats.lexing)};
+    if (lexed)
+      rebaseTokens(result.tokens, *lexed, ast.getSourceManager());
+    else if (!lexMainFile(result.tokens, ast.getSourceManager(),
+                          ast.getLangOpts(),
+                          ast.getPreprocessor().getIdentifierTable(), punct))
+      return false;
+  }
+
+  {
+    PhaseTimer timer{stats.measure(stats.preprocessor)};
+    annotatePreprocessor(result.tokens, result.mismatches,
+                         ast.getPreprocessor(), ast.getLangOpts());
+  }
+
+  {
+    PhaseTimer timer{stats.measure(stats.matching)};
+    annotateSemantics(result.tokens, result.mismatches, stats,
+                      ast.getASTContext());
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AST cache
+
+// Location of the saved AST for a source file. Loading an AST only checks
+// the input files, so the compile commands are part of the key: after
+// changing -D, -I or -std, the file is parsed again.
+static std::string astCachePath(StringRef dir, StringRef sourcePath,
+                                const CompilationDatabase &compilations) {
+  SmallString<256> absPath{sourcePath};
+  llvm::sys::fs::make_absolute(absPath);
+
+  std::string key = absPath.str().str();
+  for (const auto &command :
+       compilations.getCompileCommands(getAbsolutePath(sourcePath))) {
+    for (const auto &arg : command.CommandLine) {
+      key += '\0';
+      key += arg;
+    }
+  }
+
+  SmallString<256> path{dir};
+  llvm::sys::path::append(
+      path, llvm::sys::path::filename(absPath) + "-" +
+                llvm::utohexstr(llvm::xxh3_64bits(key), true, 16) + ".ast");
+  return path.str().str();
+}
+
+// Load a previously saved AST. This fails if any of the input files changed
+// (by size, or by content if the modification time differs), in which case
+// the caller has to parse again.
+static std::unique_ptr<ASTUnit> loadAST(StringRef path) {
+  if (!llvm::sys::fs::exists(path))
+    return {};
+
+  auto pchOps = std::make_shared<PCHContainerOperations>();
+  IntrusiveRefCntPtr<DiagnosticsEngine> diags{new DiagnosticsEngine{
+      new DiagnosticIDs, new DiagnosticOptions, new IgnoringDiagConsumer}};
+  FileSystemOptions fileSystemOpts;
+  auto headerSearchOpts = std::make_shared<HeaderSearchOptions>();
+  headerSearchOpts->ValidateASTInputFilesContent = true;
+
+#if CLANG_VERSION_MAJOR >= 20
+  return ASTUnit::LoadFromASTFile(path.str(), pchOps->getRawReader(),
+                                  ASTUnit::LoadEverything, diags,
+                                  fileSystemOpts, *headerSearchOpts);
+#else
+  return ASTUnit::LoadFromASTFile(path.str(), pchOps->getRawReader(),
+                                  ASTUnit::LoadEverything, diags,
+                                  fileSystemOpts, headerSearchOpts);
+#endif
+}
+
+static void saveAST(ASTUnit &ast, StringRef path) {
+  // Loading ASTs with errors is not reliable, so we do not even try
+  if (ast.getDiagnostics().hasErrorOccurred())
+    return;
+
+  llvm::sys::fs::create_directories(llvm::sys::path::parent_path(path));
+  if (ast.Save(path))
+    std::cerr << "WARNING: Could not save AST to " << path.str() << "\n";
+}
+
+// GeneratePCHAction writes to the -o path, which ClangTool strips
+class GeneratePCHToFileAction : public GeneratePCHAction {
+public:
+  explicit GeneratePCHToFileAction(StringRef path) : path{path.str()} {}
+
+protected:
+  bool BeginInvocation(CompilerInstance &CI) override {
+    CI.getFrontendOpts().OutputFile = path;
+    return GeneratePCHAction::BeginInvocation(CI);
+  }
+
+private:
+  std::string path;
+};
+
+class GeneratePCHActionFactory : public FrontendActionFactory {
+public:
+  explicit GeneratePCHActionFactory(StringRef path) : path{path} {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<GeneratePCHToFileAction>(path);
+  }
+
+private:
+  StringRef path;
+};
+
+// Raw lexer tokens without any preprocessor or semantic information. This
+// does not need the compilation database and runs in linear time, so we can
+// use it if the full analysis takes too long.
+static bool highlightLexical(HighlightResult &result, StringRef path,
+                             PunctuationMode punct) {
+  FileSystemOptions fileSystemOpts;
+  FileManager files{fileSystemOpts};
+  DiagnosticsEngine diags{new DiagnosticIDs, new DiagnosticOptions,
+                          new IgnoringDiagConsumer};
+  SourceManager sourceManager{diags, files};
+
+  SmallString<256> absPath{path};
+  llvm::sys::fs::make_absolute(absPath);
+
+  auto file = files.getFileRef(absPath);
+  if (!file) {
+    llvm::errs() << "Could not open " << absPath << ": "
+                 << llvm::toString(file.takeError()) << "\n";
+    return false;
+  }
+  sourceManager.setMainFileID(
+      sourceManager.createFileID(*file, SourceLocation{}, SrcMgr::C_User));
+
+  // We do not know the actual language options without parsing the
+  // compilation database, so assume recent C++. This only influences
+  // keyword recognition.
+  LangOptions langOpts;
+  std::vector<std::string> includes;
+  LangOptions::setLangDefaults(langOpts, Language::CXX, llvm::Triple{},
+                               includes, LangStandard::lang_cxx23);
+  IdentifierTable identifiers{langOpts};
+
+  result.file = absPath.str().str();
+  result.degraded = true;
+
+  PhaseTimer timer{result.stats.measure(result.stats.lexing)};
+  return lexMainFile(result.tokens, sourceManager, langOpts, identifiers,
+                     punct);
+}
+
+// Apply a custom category to all command-line options so that they are the
+// only ones displayed.
+static llvm::cl::OptionCategory MyCategory("clang_highlight options");
+
+// CommonOptionsParser declares HelpMessage with a description of the common
+// command-line options related to the compilation database and input files.
+// It's nice to have this help message in all tools.
+static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
+
+static cl::opt<PunctuationMode> OptPunctMode{
+    "punctuation", cl::desc{"Choose which punctuation tokens to keep"},
+    cl::values(
+        clEnumValN(PunctuationMode::Keep, "keep",
+                   "Keep all punctuation (default)"),
+        clEnumValN(
+            PunctuationMode::KeepLinked, "linked",
+            "Keep only punctuation tokens with links (e.g. custom operators)"),
+        clEnumValN(PunctuationMode::Skip, "skip", "Skip all punctuation")),
+    cl::init(PunctuationMode::Keep), cl::cat(MyCategory)};
+
+static cl::opt<OutputFormat> OptFormat{
+    "format", cl::desc{"Choose the output format"},
+    cl::values(clEnumValN(OutputFormat::JSON, "json", "JSON (default)"),
+               clEnumValN(OutputFormat::Compact, "compact",
+                          "Compact binary encoding with delta-coded offsets "
+                          "and a link table")),
+    cl::init(OutputFormat::JSON), cl::cat(MyCategory)};
+
+static cl::opt<Compression> OptCompress{
+    "compress", cl::desc{"Compress the output of each file"},
+    cl::values(
+        clEnumValN(Compression::None, "none", "No compression (default)"),
+        clEnumValN(Compression::Zlib, "zlib", "zlib stream")),
+    cl::init(Compression::None), cl::cat(MyCategory)};
+
+static cl::opt<unsigned> OptDeadline{
+    "deadline-ms",
+    cl::desc{"If parsing and semantic analysis take longer than this, output "
+             "only lexical tokens and mark the output as degraded "
+             "(0 = no deadline)"},
+    cl::init(0), cl::cat(MyCategory)};
+
+static cl::opt<bool> OptKeepGoing{
+    "keep-going",
+    cl::desc{"Do not abort if a token cannot be found, but report it in the "
+             "\"mismatches\" list of the output"},
+    cl::init(false), cl::cat(MyCategory)};
+
+static cl::opt<bool> OptStats{
+    "stats", cl::desc{"Include processing statistics in the output"},
+    cl::init(false), cl::cat(MyCategory)};
+
+static cl::opt<bool> OptAllConfigs{
+    "all-configs",
+    cl::desc{"Highlight the file under each of its compile commands and merge "
+             "the results. Links are taken from the first configuration that "
+             "has one, differences are listed per token."},
+    cl::init(false), cl::cat(MyCategory)};
+
+static cl::opt<std::string> OptSaveAST{
+    "save-ast", cl::desc{"Save the parsed AST to this directory"},
+    cl::value_desc{"dir"}, cl::cat(MyCategory)};
+
+static cl::opt<std::string> OptLoadAST{
+    "load-ast",
+    cl::desc{"Use the AST saved with --save-ast in this directory instead of "
+             "parsing, if it is still up to date"},
+    cl::value_desc{"dir"}, cl::cat(MyCategory)};
+
+static cl::opt<unsigned> OptJobs{
+    "jobs",
+    cl::desc{"Number of worker processes if multiple files are given. In "
+             "that case, each result is written as a single line of JSON."},
+    cl::init(1), cl::cat(MyCategory)};
+
+static cl::opt<std::string> OptGeneratePCH{
+    "generate-pch",
+    cl::desc{"Instead of highlighting, compile the given header into a "
+             "precompiled header, which other files can use with -include-pch"},
+    cl::value_desc{"file"}, cl::cat(MyCategory)};
+
+static cl::opt<bool> OptDecodeCompact{
+    "decode-compact",
+    cl::desc{"Instead of highlighting, read the given results of "
+             "--format=compact and print them as JSON"},
+    cl::cat(MyCategory)};
+
+static cl::opt<std::string> OptArchive{
+    "archive",
+    cl::desc{"Write the results of all files into a single archive with a "
+             "path index instead of printing them"},
+    cl::value_desc{"file"}, cl::cat(MyCategory)};
+
+static cl::opt<std::string> OptOutput{
+    "o", cl::desc{"Write the output to this file instead of stdout"},
+    cl::value_desc{"file"}, cl::cat(MyCategory)};
+
+// The JSON output of a large file has several MB, which we write in a few
+// large chunks instead of many small ones
+static constexpr std::size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
+// // A help message for this specific tool can be added afterwards.
+// static cl::extrahelp MoreHelp("\nMore help text...\n");
+
+////////////////////////////////////////////////////////////////////////////////
+// Compilation database index
+//
+// Parsing a large compile_commands.json takes seconds, although we only need
+// the commands of a few files. Next to it, we keep an index from file path to
+// the byte range of its entries, which is rebuilt when the JSON changes (by
+// size or modification time). All integers are little-endian uint64:
+//
+//   "CHCCIDX1"
+//   Header: JSON size, JSON mtime (ns), number of buckets, number of entries
+//   Buckets: index of the first entry in each bucket, followed by the end
+//   Entries: {path hash, JSON offset, JSON size}, sorted by bucket
+//
+// The index is memory-mapped, and only the entries of the requested file are
+// read from the JSON. Files that are not in the index (e.g. headers, for
+// which clang infers a command from similar files) fall back to the full
+// database.
+
+static constexpr const char *COMPDB_INDEX_MAGIC = "CHCCIDX1";
+static constexpr std::size_t COMPDB_INDEX_HEADER_SIZE = 8 + 4 * 8;
+
+// Smaller databases are parsed quickly enough
+static constexpr std::uint64_t COMPDB_INDEX_MIN_SIZE = 1 << 20;
+
+// Hash of a file path, normalized the same way JSONCompilationDatabase does
+static std::uint64_t compDBPathHash(StringRef directory, StringRef file) {
+  SmallString<256> path;
+  if (llvm::sys::path::is_relative(file)) {
+    SmallString<256> absolute{directory};
+    llvm::sys::path::append(absolute, file);
+    llvm::sys::path::native(absolute, path);
+  } else
+    llvm::sys::path::native(file, path);
+
+  llvm::sys::path::remove_dots(path, true);
+  return llvm::xxh3_64bits(path);
+}
+
+static bool fileStamp(StringRef path, std::uint64_t &size,
+                      std::uint64_t &mtime) {
+  llvm::sys::fs::file_status status;
+  if (llvm::sys::fs::status(path, status))
+    return false;
+
+  size = status.getSize();
+  mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              status.getLastModificationTime().time_since_epoch())
+              .count();
+  return true;
+}
+
+static bool writeCompDBIndex(StringRef jsonPath, StringRef indexPath,
+                             std::uint64_t size, std::uint64_t mtime) {
+  auto json = llvm::MemoryBuffer::getFile(jsonPath, /*IsText=*/false,
+                                          /*RequiresNullTerminator=*/false);
+  if (!json || (*json)->getBufferSize() != size)
+    return false;
+
+  struct Entry {
+    std::uint64_t hash;
+    std::uint64_t offset;
+    std::uint64_t size;
+  };
+  std::vector<Entry> entries;
+
+  // Find the top-level objects without building the whole document. Each
+  // of them is small enough to be parsed on its own.
+  StringRef text = (*json)->getBuffer();
+  unsigned int depth = 0;
+  std::size_t start = 0;
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    switch (text[i]) {
+    case '"':
+      for (++i; i < text.size() && text[i] != '"'; ++i) {
+        if (text[i] == '\\')
+          ++i;
+      }
+      break;
+    case '[':
+    case '{':
+      if (depth++ == 1)
+        start = i;
+      break;
+    case ']':
+    case '}':
+      if (depth == 0)
+        return false;
+      if (--depth == 1) {
+        auto entry = text.slice(start, i + 1);
+        auto value = llvm::json::parse(entry);
+        if (!value) {
+          llvm::consumeError(value.takeError());
+          return false;
+        }
+
+        auto object = value->getAsObject();
+        auto directory = object ? object->getString("directory") : std::nullopt;
+        auto file = object ? object->getString("file") : std::nullopt;
+        if (!directory || !file)
+          return false;
+
+        entries.push_back(
+            Entry{compDBPathHash(*directory, *file), start, entry.size()});
+      }
+      break;
+    }
+  }
+
+  // Stable, so that multiple commands of a file stay in order
+  std::uint64_t buckets = std::max<std::size_t>(entries.size(), 1);
+  std::ranges::stable_sort(
+      entries, {}, [&](const Entry &entry) { return entry.hash % buckets; });
+
+  // Replace atomically, other processes might be reading the old one
+  std::string tmpPath =
+      (indexPath + "." + std::to_string(::getpid()) + ".tmp").str();
+  {
+    std::error_code error;
+    llvm::raw_fd_ostream out{tmpPath, error, llvm::sys::fs::OF_None};
+    if (error)
+      return false;
+
+    auto writeU64 = [&](std::uint64_t value) {
+      char bytes[8];
+      llvm::support::endian::write64le(bytes, value);
+      out.write(bytes, 8);
+    };
+
+    out.write(COMPDB_INDEX_MAGIC, 8);
+    writeU64(size);
+    writeU64(mtime);
+    writeU64(buckets);
+    writeU64(entries.size());
+
+    std::size_t next = 0;
+    for (std::uint64_t bucket = 0; bucket <= buckets; ++bucket) {
+      while (next < entries.size() && entries[next].hash % buckets < bucket)
+        next++;
+      writeU64(next);
+    }
+
+    for (const auto &entry : entries) {
+      writeU64(entry.hash);
+      writeU64(entry.offset);
+      writeU64(entry.size);
+    }
+
+    out.close();
+    if (out.has_error()) {
+      out.clear_error();
+      llvm::sys::fs::remove(tmpPath);
+      return false;
+    }
+  }
+
+  if (llvm::sys::fs::rename(tmpPath, indexPath)) {
+    llvm::sys::fs::remove(tmpPath);
+    return false;
+  }
+  return true;
+}
+
+// Map the index, if it exists and belongs to the current JSON
+static std::unique_ptr<llvm::MemoryBuffer>
+readCompDBIndex(StringRef indexPath, std::uint64_t size, std::uint64_t mtime) {
+  auto index = llvm::MemoryBuffer::getFile(indexPath, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+  if (!index)
+    return nullptr;
+
+  StringRef data = (*index)->getBuffer();
+  if (data.size() < COMPDB_INDEX_HEADER_SIZE ||
+      !data.starts_with(COMPDB_INDEX_MAGIC))
+    return nullptr;
+
+  auto u64 = [&](std::size_t offset) {
+    return llvm::support::endian::read64le(data.data() + offset);
+  };
+  if (u64(8) != size || u64(16) != mtime)
+    return nullptr;
+
+  // Limited first, so that the size check cannot overflow
+  std::uint64_t buckets = u64(24);
+  std::uint64_t entries = u64(32);
+  if (buckets == 0 || buckets > data.size() / 8 || entries > data.size() / 24 ||
+      data.size() != COMPDB_INDEX_HEADER_SIZE + (buckets + 1) * 8 +
+                         entries * 3 * 8)
+    return nullptr;
+
+  return std::move(*index);
+}
+
+class IndexedCompilationDatabase : public CompilationDatabase {
+public:
+  IndexedCompilationDatabase(std::string jsonPath,
+                             std::unique_ptr<llvm::MemoryBuffer> index)
+      : jsonPath{std::move(jsonPath)}, index{std::move(index)} {}
+
+  std::vector<CompileCommand>
+  getCompileCommands(StringRef filePath) const override {
+    auto commands = lookup(filePath);
+    if (!commands.empty())
+      return commands;
+
+    if (auto db = full())
+      return db->getCompileCommands(filePath);
+    return {};
+  }
+
+  std::vector<std::string> getAllFiles() const override {
+    if (auto db = full())
+      return db->getAllFiles();
+    return {};
+  }
+
+  std::vector<CompileCommand> getAllCompileCommands() const override {
+    if (auto db = full())
+      return db->getAllCompileCommands();
+    return {};
+  }
+
+private:
+  std::uint64_t u64(std::size_t offset) const {
+    return llvm::support::endian::read64le(index->getBufferStart() + offset);
+  }
+
+  // Parse only the entries of the file. A damaged index falls back to the
+  // full database.
+  std::vector<CompileCommand> lookup(StringRef filePath) const {
+    std::uint64_t hash = compDBPathHash({}, filePath);
+    std::uint64_t jsonSize = u64(8);
+    std::uint64_t buckets = u64(24);
+    std::uint64_t entryCount = u64(32);
+    std::size_t bucketOffset = COMPDB_INDEX_HEADER_SIZE + hash % buckets * 8;
+    std::size_t entryBase = COMPDB_INDEX_HEADER_SIZE + (buckets + 1) * 8;
+
+    std::uint64_t begin = u64(bucketOffset);
+    std::uint64_t end = u64(bucketOffset + 8);
+    if (begin > end || end > entryCount)
+      return {};
+
+    std::string entries = "[";
+    for (auto i = begin; i < end; ++i) {
+      std::size_t entry = entryBase + i * 3 * 8;
+      if (u64(entry) != hash)
+        continue;
+
+      std::uint64_t offset = u64(entry + 8);
+      std::uint64_t size = u64(entry + 16);
+      if (offset > jsonSize || size > jsonSize - offset)
+        return {};
+
+      auto slice = llvm::MemoryBuffer::getFileSlice(jsonPath, size, offset);
+      if (!slice)
+        return {};
+
+      if (entries.size() > 1)
+        entries += ",";
+      entries += (*slice)->getBuffer();
+    }
+    if (entries.size() == 1)
+      return {};
+    entries += "]";
+
+    std::string error;
+    std::unique_ptr<CompilationDatabase> db =
+        JSONCompilationDatabase::loadFromBuffer(
+            entries, error, JSONCommandLineSyntax::AutoDetect);
+    if (!db)
+      return {};
+
+    // Same as the JSON plugin, except for the interpolation of missing
+    // files, which needs all of them
+    db = inferTargetAndDriverMode(
+        expandResponseFiles(std::move(db), llvm::vfs::getRealFileSystem()));
+    return db->getCompileCommands(filePath);
+  }
+
+  // The whole database, as loaded by the JSON plugin
+  const CompilationDatabase *full() const {
+    std::call_once(fullLoaded, [this]() {
+      std::string error;
+      auto db = JSONCompilationDatabase::loadFromFile(
+          jsonPath, error, JSONCommandLineSyntax::AutoDetect);
+      if (!db) {
+        std::cerr << "WARNING: Could not load " << jsonPath << ": " << error
+                  << "\n";
+        return;
+      }
+
+      fullDatabase = inferTargetAndDriverMode(
+          inferMissingCompileCommands(expandResponseFiles(
+              std::move(db), llvm::vfs::getRealFileSystem())));
+    });
+    return fullDatabase.get();
+  }
+
+  std::string jsonPath;
+  std::unique_ptr<llvm::MemoryBuffer> index;
+
+  mutable std::once_flag fullLoaded;
+  mutable std::unique_ptr<CompilationDatabase> fullDatabase;
+};
+
+// The indexed database of the compile_commands.json in the build directory,
+// if it is large enough to be worth it (and could be indexed)
+static std::unique_ptr<CompilationDatabase>
+loadIndexedCompilationDatabase(StringRef directory) {
+  SmallString<256> jsonPath{directory};
+  llvm::sys::path::append(jsonPath, "compile_commands.json");
+
+  std::uint64_t size, mtime;
+  if (!fileStamp(jsonPath, size, mtime) || size < COMPDB_INDEX_MIN_SIZE)
+    return nullptr;
+
+  std::string indexPath = (jsonPath.str() + ".chidx").str();
+  auto index = readCompDBIndex(indexPath, size, mtime);
+  if (!index && writeCompDBIndex(jsonPath, indexPath, size, mtime))
+    index = readCompDBIndex(indexPath, size, mtime);
+
+  if (!index)
+    return nullptr;
+
+  return std::make_unique<IndexedCompilationDatabase>(jsonPath.str().str(),
+                                                      std::move(index));
+}
+
+// CommonOptionsParser loads the database of -p by parsing all of it. To use
+// the index instead, we look for -p before and hide it behind an empty fixed
+// database ("--"), which the parser prefers. An explicit "--" is kept as is.
+static std::unique_ptr<CompilationDatabase>
+preloadIndexedCompilationDatabase(std::vector<const char *> &args) {
+  std::optional<StringRef> buildPath;
+  for (std::size_t i = 1; i < args.size(); ++i) {
+    StringRef arg = args[i];
+    if (arg == "--")
+      return nullptr;
+
+    if ((arg == "-p" || arg == "--p") && i + 1 < args.size())
+      buildPath = args[++i];
+    else if (arg.consume_front("-p=") || arg.consume_front("--p="))
+      buildPath = arg;
+  }
+  if (!buildPath)
+    return nullptr;
+
+  auto db = loadIndexedCompilationDatabase(*buildPath);
+  if (db)
+    args.push_back("--");
+  return db;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Driver
+
+// Precompiled headers used by the files of a batch (-include-pch), by
+// absolute path. The supervisor reads them before it forks the workers, so
+// that these share one copy instead of each reading the file again.
+static llvm::StringMap<std::unique_ptr<llvm::MemoryBuffer>> PreloadedPCHs;
+
+static void preloadPCHs(const CompilationDatabase &compilations,
+                        const std::vector<std::string> &files) {
+  for (const auto &file : files) {
+    for (const auto &command : compilations.getCompileCommands(file)) {
+      const auto &args = command.CommandLine;
+      for (std::size_t i = 0; i + 1 < args.size(); ++i) {
+        if (args[i] != "-include-pch")
+          continue;
+
+        SmallString<256> path{args[i + 1]};
+        llvm::sys::fs::make_absolute(command.Directory, path);
+        if (PreloadedPCHs.contains(path))
+          continue;
+
+        // Volatile, so that the file is read now instead of mapped lazily
+        auto buffer = llvm::MemoryBuffer::getFile(
+            path, /*IsText=*/false, /*RequiresNullTerminator=*/false,
+            /*IsVolatile=*/true);
+        if (buffer)
+          PreloadedPCHs[path] = std::move(*buffer);
+      }
+    }
+  }
+}
+
+static void configureTool(ClangTool &tool) {
+  // We need information about preprocessor operation to highlight
+  // preprocessor directives and macro instantiations properly
+  tool.appendArgumentsAdjuster(
+      getInsertArgumentAdjuster({"-Xclang", "-detailed-preprocessing-record"},
+                                ArgumentInsertPosition::END));
+
+  // Load additional clang flags from our config directory
+  tool.appendArgumentsAdjuster(
+      getInsertArgumentAdjuster({"--config-user-dir=~/.config/clang-highlight",
+                                 "--config-system-dir=/etc/clang-highlight"},
+                                ArgumentInsertPosition::BEGIN));
+
+  for (const auto &entry : PreloadedPCHs)
+    tool.mapVirtualFile(entry.getKey(), entry.getValue()->getBuffer());
+
+  // Record input file hashes, so that saved ASTs survive touched files
+  if (!OptSaveAST.empty())
+    tool.appendArgumentsAdjuster(
+        getInsertArgumentAdjuster("-fvalidate-ast-input-files-content",
+                                  ArgumentInsertPosition::END));
+}
+
+// Everything the analysis thread of one file works on. This lives on the
+// heap, since we might have to abandon the thread (see --deadline-ms).
+struct HighlightJob {
+  HighlightJob(const CompilationDatabase &compilations,
+               const std::string &sourcePath)
+      : compilations{compilations}, sourcePath{sourcePath},
+        tool{compilations, ArrayRef<std::string>{this->sourcePath}} {
+    configureTool(tool);
+    result.mismatches.fatal = !OptKeepGoing;
+    result.stats.measurePhases = OptStats;
+  }
+
+  const CompilationDatabase &compilations;
+  std::string sourcePath;
+  ClangTool tool;
+  HighlightResult result;
+  std::promise<int> finished;
+};
+
+// Merge the results of the other configurations into result. Tokens are
+// compared if they have the same offset and length in both, where the token
+// boundaries differ (e.g. for includes), there is nothing to compare.
+static void mergeConfigurations(HighlightResult &result,
+                                std::vector<HighlightResult> &others) {
+  std::vector<const ResultToken *> candidates;
+  for (auto &[offset, token] : result.tokens) {
+    candidates.assign(1, &token);
+    for (const auto &other : others) {
+      auto it = other.tokens.find(offset);
+      bool same = it != other.tokens.end() &&
+                  it->second.token.getLength() == token.token.getLength();
+      candidates.push_back(same ? &it->second : nullptr);
+    }
+
+    // The first configuration with a link wins
+    auto merged = std::ranges::find_if(
+        candidates, [](const ResultToken *c) { return c && c->link; });
+    if (merged == candidates.end())
+      merged = candidates.begin();
+
+    auto type = (*merged)->type;
+    auto link = (*merged)->link;
+    auto linkedDecl = (*merged)->linkedDecl;
+
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+      auto c = candidates[i];
+      if (c && (c->type != type || c->link != link))
+        token.variants.push_back(ResultToken::Variant{
+            .configuration = i, .type = c->type, .link = c->link});
+    }
+
+    token.type = type;
+    token.link = std::move(link);
+    token.linkedDecl = linkedDecl;
+  }
+
+  for (auto &mismatch : result.mismatches.mismatches)
+    mismatch.configuration = 0;
+
+  for (std::size_t i = 0; i < others.size(); ++i) {
+    for (auto mismatch : others[i].mismatches.mismatches) {
+      mismatch.configuration = i + 1;
+      result.mismatches.mismatches.push_back(mismatch);
+    }
+    result.otherASTs.push_back(std::move(others[i].ast));
+  }
+}
+
+// Language options that change how the main file is lexed: which identifiers
+// are keywords (see clang/Basic/TokenKinds.def) and which tokens exist
+static auto lexingOptions(const LangOptions &opts) {
+  return std::tuple{opts.LangStd,
+                    opts.GNUKeywords,
+                    opts.MicrosoftExt,
+                    opts.MSVCCompat,
+                    opts.MSCompatibilityVersion,
+                    opts.DeclSpecKeyword,
+                    opts.Borland,
+                    opts.Char8,
+                    opts.Bool,
+                    opts.Half,
+                    opts.WChar,
+                    opts.CUDA,
+                    opts.OpenCL,
+                    opts.OpenCLCPlusPlus,
+                    opts.HLSL,
+                    opts.SYCLIsDevice,
+                    opts.AltiVec,
+                    opts.ZVector,
+                    opts.ObjC,
+                    opts.Coroutines,
+                    opts.Modules,
+                    opts.Digraphs,
+                    opts.Trigraphs,
+                    opts.DollarIdents};
+}
+
+// Highlight the file in each configuration (see --all-configs). They share
+// the file manager of the tool, and the main file is lexed only once.
+// Parsing is sequential, since the file manager is not thread-safe.
+static bool
+highlightConfigurations(HighlightJob &job,
+                        std::vector<std::unique_ptr<ASTUnit>> ASTs) {
+  auto &result = job.result;
+  auto &stats = result.stats;
+
+  // In the order in which ClangTool built the ASTs
+  auto commands =
+      job.compilations.getCompileCommands(getAbsolutePath(job.sourcePath));
+  for (std::size_t i = 0; i < ASTs.size(); ++i) {
+    result.configurations.push_back(
+        i < commands.size() ? llvm::join(commands[i].CommandLine, " ")
+                            : "configuration " + std::to_string(i));
+  }
+
+  auto &first = *ASTs.front();
+  TokenMap lexed;
+  {
+    PhaseTimer timer{stats.measure(stats.lexing)};
+    if (!lexMainFile(lexed, first.getSourceManager(), first.getLangOpts(),
+                     first.getPreprocessor().getIdentifierTable(),
+                     OptPunctMode))
+      return false;
+  }
+
+  // Keywords depend on the language options (e.g. -fchar8_t or
+  // -fms-extensions), so we only share the tokens between configurations
+  // which lex the same way
+  auto lexedOptions = lexingOptions(first.getLangOpts());
+
+  std::vector<HighlightResult> others(ASTs.size() - 1);
+  for (std::size_t i = 0; i < ASTs.size(); ++i) {
+    auto &config = i == 0 ? result : others[i - 1];
+    config.mismatches.fatal = result.mismatches.fatal;
+    config.ast = std::move(ASTs[i]);
+
+    bool shared = lexingOptions(config.ast->getLangOpts()) == lexedOptions;
+    if (!highlightAST(config, OptPunctMode, shared ? &lexed : nullptr))
+      return false;
+  }
+
+  mergeConfigurations(result, others);
+  return true;
+}
+
+// Parse & annotate
+static int analyze(HighlightJob &job) {
+  auto &result = job.result;
+  auto &stats = result.stats;
+
+  if (!OptLoadAST.empty()) {
+    {
+      PhaseTimer timer{stats.measure(stats.parsing)};
+      result.ast = loadAST(
+          astCachePath(OptLoadAST, job.sourcePath, job.compilations));
+    }
+
+    if (result.ast)
+      return highlightAST(result, OptPunctMode) ? 0 : 1;
+  }
+
+  std::vector<std::unique_ptr<ASTUnit>> ASTs;
+  {
+    PhaseTimer timer{stats.measure(stats.parsing)};
+    if (auto ret = job.tool.buildASTs(ASTs))
+      return ret;
+  }
+
+  if (OptAllConfigs && ASTs.size() > 1)
+    return highlightConfigurations(job, std::move(ASTs)) ? 0 : 1;
+
+  result.ast = std::move(ASTs.front());
+
+  if (!OptSaveAST.empty())
+    saveAST(*result.ast,
+            astCachePath(OptSaveAST, job.sourcePath, job.compilations));
+
+  return highlightAST(result, OptPunctMode) ? 0 : 1;
+}
+
+static void dumpEncoded(llvm::raw_ostream &out, const HighlightResult &result,
+                        unsigned int indent) {
+  if (OptFormat == OutputFormat::Compact)
+    dumpCompact(out, result, OptPunctMode);
+  else
+    dumpJSON(out, result, OptPunctMode, OptStats, indent);
+}
+
+static void dumpResult(llvm::raw_ostream &out, const HighlightResult &result,
+                       unsigned int indent) {
+  if (OptCompress == Compression::None) {
+    dumpEncoded(out, result, indent);
+    return;
+  }
+
+  // Nobody reads compressed JSON, so there is no point in indenting it
+  std::string encoded;
+  llvm::raw_string_ostream stream{encoded};
+  dumpEncoded(stream, result, 0);
+  stream.flush();
+
+  llvm::SmallVector<std::uint8_t, 0> compressed;
+  llvm::compression::zlib::compress(llvm::arrayRefFromStringRef(encoded),
+                                    compressed);
+  out << llvm::toStringRef(compressed);
+}
+
+// analyze(), but a token we could not find (without --keep-going) is reported
+// as a failure of this file. Nothing may escape the worker thread, since that
+// would terminate the process, even after we moved on to the lexical fallback.
+static int analyzeOrReport(HighlightJob &job) {
+  try {
+    return analyze(job);
+  } catch (const std::exception &e) {
+    std::cerr << "ERROR: " << job.sourcePath << ": " << e.what() << "\n";
+    return 1;
+  }
+}
+
+// Highlight one file and write the result to out. In batch mode, the result
+// names its input. If this sets abandoned, the analysis thread is still
+// running and the process has to exit without cleanup.
+static int highlightFile(const CompilationDatabase &compilations,
+                         const std::string &sourcePath,
+                         llvm::raw_ostream &out, unsigned int indent,
+                         bool batch, bool &abandoned) {
+  auto job = std::make_unique<HighlightJob>(compilations, sourcePath);
+
+  if (OptDeadline != 0) {
+    // Parse & annotate in a separate thread, so that we can give up on it
+    // once the deadline has passed.
+    auto status = job->finished.get_future();
+    std::thread worker{[job = job.get()]() {
+      job->finished.set_value(analyzeOrReport(*job));
+    }};
+
+    if (status.wait_for(std::chrono::milliseconds{OptDeadline}) ==
+        std::future_status::timeout) {
+      std::cerr << "WARNING: Deadline of " << OptDeadline
+                << " ms exceeded for " << sourcePath
+                << ", falling back to lexical highlighting\n";
+
+      // clang cannot be interrupted, so we leave the worker running
+      worker.detach();
+      job.release();
+      abandoned = true;
+
+      HighlightResult lexical;
+      lexical.stats.measurePhases = OptStats;
+      if (!highlightLexical(lexical, sourcePath, OptPunctMode))
+        return 1;
+      if (batch)
+        lexical.input = sourcePath;
+
+      dumpResult(out, lexical, indent);
+      return 0;
+    }
+
+    worker.join();
+    if (auto exitCode = status.get())
+      return exitCode;
+  } else if (auto exitCode = analyzeOrReport(*job))
+    return exitCode;
+
+  auto &result = job->result;
+  if (batch)
+    result.input = sourcePath;
+  if (auto count = result.mismatches.mismatches.size())
+    std::cerr << "WARNING: Could not find " << count << " tokens in "
+              << sourcePath << "\n";
+
+  dumpResult(out, result, indent);
+
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Archive output
+
+// Instead of one JSON document per file, the results of a batch run can be
+// written into a single archive. All integers are little-endian uint64:
+//
+//   "CHARCHV1"
+//   JSON documents, one per file, in order of completion
+//   Index: {path offset, path size, JSON offset, JSON size} for each file,
+//          sorted by path
+//   Paths
+//   Footer: index offset, number of files, "CHINDEX1"
+//
+// Since the index is at the end, results can be written as they arrive.
+// Readers mmap() the archive and binary-search the index to find a file.
+class ArchiveWriter {
+public:
+  explicit ArchiveWriter(const std::string &path)
+      : out{path, std::ios::binary | std::ios::trunc} {
+    out.write(MAGIC, 8);
+    offset = 8;
+  }
+
+  bool good() const { return out.good(); }
+
+  void add(StringRef file, StringRef json) {
+    // Paths are normalized, so that readers can find them again
+    SmallString<256> path{file};
+    llvm::sys::fs::make_absolute(path);
+    llvm::sys::path::remove_dots(path, true);
+
+    entries.push_back(Entry{path.str().str(), offset, json.size()});
+    out.write(json.data(), json.size());
+    offset += json.size();
+  }
+
+  bool finish() {
+    std::ranges::sort(entries, {}, &Entry::path);
+
+    std::uint64_t indexOffset = offset;
+    std::uint64_t pathOffset = indexOffset + entries.size() * 4 * 8;
+    for (const auto &entry : entries) {
+      writeU64(pathOffset);
+      writeU64(entry.path.size());
+      writeU64(entry.offset);
+      writeU64(entry.size);
+      pathOffset += entry.path.size();
+    }
+
+    for (const auto &entry : entries)
+      out.write(entry.path.data(), entry.path.size());
+
+    writeU64(indexOffset);
+    writeU64(entries.size());
+    out.write(INDEX_MAGIC, 8);
+
+    out.close();
+    return !out.fail();
+  }
+
+private:
+  static constexpr const char *MAGIC = "CHARCHV1";
+  static constexpr const char *INDEX_MAGIC = "CHINDEX1";
+
+  struct Entry {
+    std::string path;
+    std::uint64_t offset;
+    std::uint64_t size;
+  };
+
+  void writeU64(std::uint64_t value) {
+    char bytes[8];
+    for (int i = 0; i < 8; ++i)
+      bytes[i] = static_cast<char>(value >> (8 * i));
+    out.write(bytes, 8);
+  }
+
+  std::ofstream out;
+  std::uint64_t offset = 0;
+  std::vector<Entry> entries;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Batch mode
+//
+// Multiple files are highlighted by worker processes forked from the
+// supervisor, which has already initialized LLVM and loaded the compilation
+// database. That is much cheaper than starting a new process per file, and a
+// crash in clang only takes down a single worker. Crashed workers are
+// restarted and their file is reported as failed.
+
+static bool writeAll(int fd, const void *data, std::size_t size) {
+  auto ptr = static_cast<const char *>(data);
+  while (size != 0) {
+    auto ret = ::write(fd, ptr, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static bool readAll(int fd, void *data, std::size_t size) {
+  auto ptr = static_cast<char *>(data);
+  while (size != 0) {
+    auto ret = ::read(fd, ptr, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+
+    ptr += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+// Header of a result sent from worker to supervisor
+struct WorkerMessage {
+  std::uint64_t size;
+
+  // Worker exits after this message (see highlightFile())
+  bool exiting;
+};
+
+struct Worker {
+  pid_t pid = -1;
+  int taskFD = -1;   // supervisor -> worker: file indices
+  int resultFD = -1; // worker -> supervisor: WorkerMessage + JSON
+
+  // Index of the file the worker is busy with
+  std::optional<std::uint32_t> task;
+};
+
+[[noreturn]] static void workerMain(const CompilationDatabase &compilations,
+                                    const std::vector<std::string> &files,
+                                    int taskFD, int resultFD) {
+  std::uint32_t index;
+  while (readAll(taskFD, &index, sizeof(index))) {
+    std::string payload;
+    llvm::raw_string_ostream out{payload};
+    bool abandoned = false;
+    int exitCode =
+        highlightFile(compilations, files[index], out, 0, true, abandoned);
+    if (exitCode != 0) {
+      out.flush();
+      payload.clear();
+      dumpError(out, files[index], "highlighting failed");
+    }
+    out.flush();
+
+    WorkerMessage msg{.size = payload.size(), .exiting = abandoned};
+    if (!writeAll(resultFD, &msg, sizeof(msg)) ||
+        !writeAll(resultFD, payload.data(), payload.size()))
+      std::_Exit(1);
+
+    if (abandoned)
+      std::_Exit(0);
+  }
+
+  std::_Exit(0);
+}
+
+static bool startWorker(Worker &worker, std::vector<Worker> &workers,
+                        const CompilationDatabase &compilations,
+                        const std::vector<std::string> &files,
+                        llvm::raw_ostream &out) {
+  int tasks[2];
+  int results[2];
+  if (::pipe(tasks) != 0)
+    return false;
+  if (::pipe(results) != 0) {
+    ::close(tasks[0]);
+    ::close(tasks[1]);
+    return false;
+  }
+
+  // Do not duplicate buffered output into the child
+  out.flush();
+
+  pid_t pid = ::fork();
+  if (pid < 0) {
+    for (int fd : {tasks[0], tasks[1], results[0], results[1]})
+      ::close(fd);
+    return false;
+  }
+
+  if (pid == 0) {
+    // Otherwise the other workers would not notice when we close their
+    // task pipe.
+    for (auto &other : workers) {
+      if (other.pid > 0) {
+        ::close(other.taskFD);
+        ::close(other.resultFD);
+      }
+    }
+    ::close(tasks[1]);
+    ::close(results[0]);
+
+    workerMain(compilations, files, tasks[0], results[1]);
+  }
+
+  ::close(tasks[0]);
+  ::close(results[1]);
+
+  worker.pid = pid;
+  worker.taskFD = tasks[1];
+  worker.resultFD = results[0];
+  worker.task.reset();
+  return true;
+}
+
+static void stopWorker(Worker &worker, int *status = nullptr) {
+  ::close(worker.taskFD);
+  ::close(worker.resultFD);
+
+  int localStatus;
+  ::waitpid(worker.pid, status ? status : &localStatus, 0);
+
+  worker.pid = -1;
+  worker.task.reset();
+}
+
+static std::string describeExit(int status) {
+  if (WIFSIGNALED(status))
+    return std::string{"worker killed by signal "} +
+           ::strsignal(WTERMSIG(status));
+  if (WIFEXITED(status))
+    return "worker exited with code " + std::to_string(WEXITSTATUS(status));
+  return "worker died";
+}
+
+static int runBatch(const CompilationDatabase &compilations,
+                    const std::vector<std::string> &files, unsigned int jobs,
+                    llvm::raw_ostream &out, ArchiveWriter *archive) {
+  // A worker that exits is noticed via its pipes
+  std::signal(SIGPIPE, SIG_IGN);
+
+  preloadPCHs(compilations, files);
+
+  std::vector<Worker> workers(std::clamp<std::size_t>(jobs, 1, files.size()));
+  std::size_t nextFile = 0;
+  std::size_t doneFiles = 0;
+  int exitCode = 0;
+
+  auto emit = [&](std::uint32_t index, const std::string &payload) {
+    if (archive)
+      archive->add(files[index], payload);
+    else {
+      out << payload;
+      // Readers of a pipe get each result as soon as it is done
+      if (OptOutput.empty())
+        out.flush();
+    }
+    doneFiles++;
+  };
+
+  auto fail = [&](std::uint32_t index, const std::string &message) {
+    std::cerr << "ERROR: " << files[index] << ": " << message << "\n";
+    std::string error;
+    llvm::raw_string_ostream errorStream{error};
+    dumpError(errorStream, files[index], message);
+    errorStream.flush();
+    emit(index, error);
+    exitCode = 1;
+  };
+
+  // Hand out the next file to an idle worker, restarting it if necessary
+  auto assign = [&](Worker &worker) {
+    while (nextFile < files.size()) {
+      if (worker.pid < 0 &&
+          !startWorker(worker, workers, compilations, files, out)) {
+        std::cerr << "ERROR: Could not start worker: " << std::strerror(errno)
+                  << "\n";
+        return;
+      }
+
+      std::uint32_t index = nextFile;
+      if (writeAll(worker.taskFD, &index, sizeof(index))) {
+        worker.task = index;
+        nextFile++;
+        return;
+      }
+
+      // The worker is gone before it even got the task, try again
+      stopWorker(worker);
+    }
+  };
+
+  for (auto &worker : workers)
+    assign(worker);
+
+  while (doneFiles < files.size()) {
+    std::vector<pollfd> fds;
+    std::vector<Worker *> busy;
+    for (auto &worker : workers) {
+      if (worker.task) {
+        fds.push_back(pollfd{.fd = worker.resultFD, .events = POLLIN});
+        busy.push_back(&worker);
+      }
+    }
+
+    if (busy.empty()) {
+      // We could not start any worker
+      while (nextFile < files.size())
+        fail(nextFile++, "could not start worker");
+      break;
+    }
+
+    if (::poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "ERROR: poll() failed: " << std::strerror(errno) << "\n";
+      return 1;
+    }
+
+    for (std::size_t i = 0; i < fds.size(); ++i) {
+      if (fds[i].revents == 0)
+        continue;
+
+      Worker &worker = *busy[i];
+      auto index = *worker.task;
+
+      WorkerMessage msg;
+      std::string payload;
+      bool received = readAll(worker.resultFD, &msg, sizeof(msg));
+      if (received) {
+        payload.resize(msg.size);
+        received = readAll(worker.resultFD, payload.data(), payload.size());
+      }
+
+      if (!received) {
+        int status = 0;
+        stopWorker(worker, &status);
+        fail(index, describeExit(status));
+      } else {
+        emit(index, payload);
+
+        worker.task.reset();
+        if (msg.exiting)
+          stopWorker(worker);
+      }
+
+      assign(worker);
+    }
+  }
+
+  for (auto &worker : workers) {
+    if (worker.pid > 0)
+      stopWorker(worker);
+  }
+
+  if (archive && !archive->finish()) {
+    std::cerr << "ERROR: Could not write archive " << OptArchive << "\n";
+    return 1;
+  }
+
+  return exitCode;
+}
+
+int main(int argc, const char **argv) {
+  cl::SetVersionPrinter([&](llvm::raw_ostream &stream) {
+    stream << "clang-highlight version " << CH_VERSION_MAJOR << "."
+           << CH_VERSION_MINOR << "." << CH_VERSION_PATCH << "\n";
+    stream << "Using " << clang::getClangFullVersion() << "\n";
+  });
+
+  std::vector<const char *> args{argv, argv + argc};
+  auto indexedCompilations = preloadIndexedCompilationDatabase(args);
+  int parsedArgc = args.size();
+
+  auto ExpectedParser = CommonOptionsParser::create(
+      parsedArgc, args.data(), MyCategory, cl::NumOccurrencesFlag::Required);
+  if (!ExpectedParser) {
+    // Fail gracefully for unsupported options.
+    llvm::errs() << ExpectedParser.takeError();
+    return 1;
+  }
+  CommonOptionsParser &OptionsParser = ExpectedParser.get();
+
+  // With the same --extra-arg(-before) handling as the parser's database
+  std::unique_ptr<ArgumentsAdjustingCompilations> adjustedIndexed;
+  if (indexedCompilations) {
+    adjustedIndexed = std::make_unique<ArgumentsAdjustingCompilations>(
+        std::move(indexedCompilations));
+    adjustedIndexed->appendArgumentsAdjuster(
+        OptionsParser.getArgumentsAdjuster());
+  }
+  CompilationDatabase &compilations =
+      adjustedIndexed ? *adjustedIndexed : OptionsParser.getCompilations();
+  auto &files = OptionsParser.getSourcePathList();
+
+  if (!OptGeneratePCH.empty()) {
+    if (files.size() != 1) {
+      std::cerr << "ERROR: --generate-pch needs exactly one header\n";
+      return 1;
+    }
+
+    // Same flags as the files that include it
+    ClangTool tool{compilations, files};
+    configureTool(tool);
+
+    GeneratePCHActionFactory factory{OptGeneratePCH};
+    return tool.run(&factory);
+  }
+
+  if (OptDecodeCompact) {
+    int exitCode = 0;
+    for (const auto &file : files) {
+      auto buffer =
+          llvm::MemoryBuffer::getFile(file, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+      if (!buffer) {
+        std::cerr << "ERROR: Could not read " << file << ": "
+                  << buffer.getError().message() << "\n";
+        exitCode = 1;
+        continue;
+      }
+
+      try {
+        dumpJSON(llvm::outs(), readCompact((*buffer)->getBuffer()));
+      } catch (const std::runtime_error &e) {
+        std::cerr << "ERROR: " << file << ": " << e.what() << "\n";
+        exitCode = 1;
+      }
+    }
+    return exitCode;
+  }
+
+  if (OptCompress == Compression::Zlib &&
+      !llvm::compression::zlib::isAvailable()) {
+    std::cerr << "ERROR: LLVM was built without zlib support\n";
+    return 1;
+  }
+
+  if (OptAllConfigs) {
+    if (!OptLoadAST.empty() || !OptSaveAST.empty()) {
+      std::cerr << "ERROR: --all-configs cannot be combined with --load-ast or "
+                   "--save-ast\n";
+      return 1;
+    }
+    if (OptFormat != OutputFormat::JSON) {
+      std::cerr << "ERROR: --all-configs needs --format=json\n";
+      return 1;
+    }
+  }
+
+  if (!OptArchive.empty()) {
+    if (!OptOutput.empty()) {
+      std::cerr << "ERROR: -o cannot be combined with --archive\n";
+      return 1;
+    }
+
+    ArchiveWriter archive{OptArchive};
+    if (!archive.good()) {
+      std::cerr << "ERROR: Could not open " << OptArchive << "\n";
+      return 1;
+    }
+    return runBatch(compilations, files, OptJobs, llvm::outs(), &archive);
+  }
+
+  std::optional<llvm::raw_fd_ostream> outputFile;
+  if (!OptOutput.empty()) {
+    std::error_code error;
+    outputFile.emplace(OptOutput, error, llvm::sys::fs::OF_None);
+    if (error) {
+      std::cerr << "ERROR: Could not open " << OptOutput << ": "
+                << error.message() << "\n";
+      return 1;
+    }
+  }
+
+  llvm::raw_ostream &out = outputFile ? *outputFile : llvm::outs();
+  out.SetBufferSize(OUTPUT_BUFFER_SIZE);
+
+  int exitCode;
+  if (files.size() > 1) {
+    if (OptFormat != OutputFormat::JSON) {
+      std::cerr << "ERROR: --format=compact needs --archive for multiple "
+                   "files\n";
+      return 1;
+    }
+    if (OptCompress != Compression::None) {
+      std::cerr << "ERROR: --compress needs --archive for multiple files\n";
+      return 1;
+    }
+    exitCode = runBatch(compilations, files, OptJobs, out, nullptr);
+  } else {
+    bool abandoned = false;
+    exitCode = highlightFile(compilations, files.front(), out, 2, false,
+                             abandoned);
+
+    if (abandoned) {
+      // Skip all cleanup, the analysis thread is still running
+      out.flush();
+      std::_Exit(exitCode);
+    }
+  }
+
+  if (outputFile) {
+    outputFile->close();
+    if (outputFile->has_error()) {
+      std::cerr << "ERROR: Could not write " << OptOutput << ": "
+                << outputFile->error().message() << "\n";
+      outputFile->clear_error();
+      return 1;
+    }
+  }
+
+  return exitCode;
 }
@@ -1,18 +1,35 @@
+import asyncio
+import mmap
+import os
 import subprocess
+import weakref
 import tempfile
 import json
-import dacite
-from typing import List, Optional
+import zlib
+from typing import Iterable, Iterator, List, Optional, Union
 from pathlib import Path
-from contextlib import contextmanager
+from contextlib import ExitStack, contextmanager
 import importlib.resources
 from importlib.metadata import version, PackageNotFoundError
 
-from .data import Token, HighlightedCode, TokenType, Link
-from . import map_stl, postprocessing
+from .data import Token, HighlightedCode, TokenType, Link, Mismatch, Variant
+from . import compact, map_stl, postprocessing
+from .archive import Archive
 
 
-__all__ = ["Token", "TokenType", "Link", "HighlightedCode", "run", "__version__"]
+__all__ = [
+    "Token",
+    "TokenType",
+    "Link",
+    "Mismatch",
+    "Variant",
+    "HighlightedCode",
+    "Archive",
+    "run",
+    "run_many",
+    "run_async",
+    "__version__",
+]
 
 
 try:
@@ -31,7 +48,7 @@ with importlib.resources.path("clang_highlight._util", "clang-highlight") as p:
 
 @contextmanager
 def build_dir_context(
-    filename: Optional[Path], build_dir: Optional[Path], args: List[str]
+    filenames: List[Optional[Path]], build_dir: Optional[Path], args: List[str]
 ):
     if build_dir is None:
         with tempfile.TemporaryDirectory() as build_dir:
@@ -46,6 +63,7 @@ def build_dir_context(
                                 "command": f"/usr/bin/c++ {' '.join(args)} {filename}",
                                 "file": str(filename),
                             }
+                            for filename in filenames
                         ]
                     )
                 )
@@ -68,6 +86,72 @@ def code_file_context(filename: Path = None, code: str = None):
         raise RuntimeError("need either filename or code")
 
 
+@contextmanager
+def _mapped_output(path: Path):
+    """
+    Memory-map the result written by `clang-highlight -o`. This only avoids
+    copies for compact or compressed results: json.loads() needs bytes, so
+    plain JSON is still copied once.
+    """
+    with open(path, "rb") as f:
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as mm:
+            yield mm
+
+
+def _load_result(
+    output: Path,
+    code_filename: Path,
+    filename: Optional[Path],
+    diagnostics: str,
+    cppref: bool,
+) -> HighlightedCode:
+    """Decode the result written by `clang-highlight -o`"""
+    with open(code_filename, "rb") as f:
+        code = f.read()
+
+    with _mapped_output(output) as raw:
+        return _decode(
+            raw,
+            filename=filename,
+            code=code,
+            diagnostics=diagnostics,
+            cppref=cppref,
+        )
+
+
+def _options(
+    punctuation="keep",
+    deadline_ms: Optional[int] = None,
+    keep_going=False,
+    stats=False,
+    ast_cache: Optional[Path] = None,
+    compact=False,
+    compress=False,
+    all_configs=False,
+) -> List[str]:
+    """Command line options of the native tool for the parameters of run()"""
+
+    options = [f"--punctuation={punctuation}"]
+    if deadline_ms is not None:
+        options.append(f"--deadline-ms={deadline_ms}")
+    if keep_going:
+        options.append("--keep-going")
+    if stats:
+        options.append("--stats")
+    if ast_cache is not None:
+        # Re-use the saved AST if it is still valid, otherwise save it
+        options += [f"--load-ast={ast_cache}", f"--save-ast={ast_cache}"]
+    if compact:
+        # Smaller, but without statistics
+        options.append("--format=compact")
+    if compress:
+        options.append("--compress=zlib")
+    if all_configs:
+        # Every compile command of the file in build_dir
+        options.append("--all-configs")
+    return options
+
+
 def run(
     filename: Path = None,
     code: str = None,
@@ -75,42 +159,301 @@ def run(
     build_dir=None,
     punctuation="keep",
     cppref=False,
+    deadline_ms: Optional[int] = None,
+    keep_going=False,
+    stats=False,
+    ast_cache: Optional[Path] = None,
+    compact=False,
+    compress=False,
+    all_configs=False,
 ) -> HighlightedCode:
     with (
         code_file_context(filename, code) as code_filename,
-        build_dir_context(filename, build_dir, args) as ch_build_dir,
+        build_dir_context([filename], build_dir, args) as ch_build_dir,
+        tempfile.TemporaryDirectory() as tmp,
     ):
+        options = _options(
+            punctuation,
+            deadline_ms,
+            keep_going,
+            stats,
+            ast_cache,
+            compact,
+            compress,
+            all_configs,
+        )
+
+        # The result is written to a file instead of a pipe, so that large
+        # outputs are not copied into memory chunk by chunk
+        output = Path(tmp) / "output"
         cmd = [
             _ch,
             "-p",
             ch_build_dir,
-            f"--punctuation={punctuation}",
+            *options,
+            "-o",
+            output,
             code_filename,
         ]
-        result = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        result = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
 
         if result.returncode != 0:
             raise RuntimeError(
                 f"clang-highlight failed. stderr:\n{result.stderr.decode('utf8')}"
             )
 
-        with open(code_filename, "rb") as f:
-            code = f.read()
+        return _load_result(
+            output, code_filename, filename, result.stderr.decode("utf8"), cppref
+        )
+
+
+# Default concurrency limit of run_async() for each event loop
+_async_limits = weakref.WeakKeyDictionary()
+
+
+async def run_async(
+    filename: Path = None,
+    code: str = None,
+    args=["-DNDEBUG", "-std=c++23"],
+    build_dir=None,
+    punctuation="keep",
+    cppref=False,
+    deadline_ms: Optional[int] = None,
+    keep_going=False,
+    stats=False,
+    ast_cache: Optional[Path] = None,
+    compact=False,
+    compress=False,
+    all_configs=False,
+    limit: Optional[asyncio.Semaphore] = None,
+) -> HighlightedCode:
+    """
+    Same as run(), but for asyncio. At most `limit` native processes run at
+    the same time (default: one per CPU). If the task is cancelled, the
+    process is killed.
+    """
+
+    if limit is None:
+        loop = asyncio.get_running_loop()
+        limit = _async_limits.get(loop)
+        if limit is None:
+            limit = _async_limits[loop] = asyncio.Semaphore(os.cpu_count())
+
+    # Temporary files are written and cleaned up in a thread, as well as
+    # decoding the result (and looking up cppreference links), so that the
+    # event loop is never blocked for long.
+    def enter_contexts(stack: ExitStack):
+        return (
+            stack.enter_context(code_file_context(filename, code)),
+            stack.enter_context(build_dir_context([filename], build_dir, args)),
+            stack.enter_context(tempfile.TemporaryDirectory()),
+        )
+
+    stack = ExitStack()
+    entering = asyncio.ensure_future(asyncio.to_thread(enter_contexts, stack))
+    try:
+        code_filename, ch_build_dir, tmp = await asyncio.shield(entering)
+
+        options = _options(
+            punctuation,
+            deadline_ms,
+            keep_going,
+            stats,
+            ast_cache,
+            compact,
+            compress,
+            all_configs,
+        )
+        output = Path(tmp) / "output"
+
+        async with limit:
+            proc = await asyncio.create_subprocess_exec(
+                _ch,
+                "-p",
+                ch_build_dir,
+                *options,
+                "-o",
+                output,
+                code_filename,
+                stdout=asyncio.subprocess.DEVNULL,
+                stderr=asyncio.subprocess.PIPE,
+            )
+            try:
+                _, stderr = await proc.communicate()
+            except BaseException:
+                if proc.returncode is None:
+                    proc.kill()
+                    await proc.wait()
+                raise
+
+        if proc.returncode != 0:
+            raise RuntimeError(
+                f"clang-highlight failed. stderr:\n{stderr.decode('utf8')}"
+            )
+
+        return await asyncio.to_thread(
+            _load_result,
+            output,
+            code_filename,
+            filename,
+            stderr.decode("utf8"),
+            cppref,
+        )
+    finally:
+        # If cancelled, the thread may still be creating the files
+        await asyncio.wait([entering])
+        await asyncio.to_thread(stack.close)
+
+
+_TOKEN_TYPES = {t.value: t for t in TokenType}
+
+
+def _parse_tokens(tokens: List[dict]) -> List[Token]:
+    """
+    Build Token instances from the JSON output. Types and paths are looked up
+    once per distinct value, and tokens linking to the same declaration share
+    their Link instance.
+    """
+
+    paths = {}
+    links = {}
+
+    def parse_link(d: dict) -> Link:
+        params = d.get("parameter_types")
+        key = (
+            d["file"],
+            d["line"],
+            d["column"],
+            d["name"],
+            d["qualified_name"],
+            tuple(params) if params else None,
+        )
+
+        link = links.get(key)
+        if link is None:
+            file = paths.get(d["file"])
+            if file is None:
+                file = paths[d["file"]] = Path(d["file"])
+
+            link = links[key] = Link(
+                file=file,
+                line=d["line"],
+                column=d["column"],
+                name=d["name"],
+                qualified_name=d["qualified_name"],
+                parameter_types=params,
+                cppref=None,
+            )
+        return link
+
+    types = _TOKEN_TYPES
 
-    data = json.loads(result.stdout)
+    def parse_variants(variants: List[dict]) -> List[Variant]:
+        return [
+            Variant(
+                configuration=v["configuration"],
+                type=types[v["type"]],
+                link=parse_link(v["link"]) if "link" in v else None,
+            )
+            for v in variants
+        ]
 
-    def parse_token(d):
-        return dacite.from_dict(
-            data_class=Token, data=d, config=dacite.Config(cast=[TokenType, Path])
+    return [
+        Token(
+            offset=d["offset"],
+            length=d["length"],
+            type=types[d["type"]],
+            link=parse_link(d["link"]) if "link" in d else None,
+            variants=parse_variants(d["variants"]) if "variants" in d else None,
         )
+        for d in tokens
+    ]
+
+
+def _parse_json(data: dict) -> dict:
+    """Convert the JSON output into the same form as compact.decode()"""
+
+    if "error" in data:
+        raise RuntimeError(
+            f"clang-highlight failed for {data['file']}: {data['error']}"
+        )
+
+    data["tokens"] = _parse_tokens(data["tokens"])
+    data["mismatches"] = [Mismatch(**m) for m in data.get("mismatches", [])]
+    return data
+
+
+# Input chunk size for decompressing --compress=zlib output
+_DECOMPRESS_CHUNK = 1 << 20
+
+
+def _is_zlib(raw: Union[bytes, mmap.mmap]) -> bool:
+    # Deflate with a 32K window, which is what LLVM writes. Neither JSON nor
+    # the compact encoding start with 0x78.
+    header = raw[:2]
+    if len(header) < 2:
+        return False
+    return header[0] == 0x78 and int.from_bytes(header, "big") % 31 == 0
+
+
+def _decompress(raw: Union[bytes, mmap.mmap]) -> bytes:
+    """
+    Decompress a result written with --compress=zlib. The input is consumed
+    in chunks, so a memory-mapped result is never copied as a whole.
+    """
+
+    decompressor = zlib.decompressobj()
+    parts = []
+    with memoryview(raw) as view:
+        for start in range(0, len(view), _DECOMPRESS_CHUNK):
+            parts.append(
+                decompressor.decompress(view[start : start + _DECOMPRESS_CHUNK])
+            )
+    parts.append(decompressor.flush())
+
+    if not decompressor.eof:
+        raise RuntimeError("truncated compressed clang-highlight result")
+    return b"".join(parts)
+
+
+def _decode(
+    raw: Union[bytes, mmap.mmap],
+    filename: Optional[Path],
+    code: bytes,
+    diagnostics: str,
+    cppref=False,
+) -> HighlightedCode:
+    """Decode the output of clang-highlight (JSON or compact, maybe compressed)"""
+
+    if _is_zlib(raw):
+        raw = _decompress(raw)
+
+    if compact.is_compact(raw):
+        data = compact.decode(raw)
+    else:
+        # json only accepts bytes, so a mapped file is copied here (no copy
+        # if raw already is bytes, e.g. after decompressing)
+        data = _parse_json(json.loads(bytes(raw)))
 
-    tokens = [parse_token(d) for d in data["tokens"]]
+    return _highlighted(data, filename, code, diagnostics, cppref)
 
+
+def _highlighted(
+    data: dict,
+    filename: Optional[Path],
+    code: bytes,
+    diagnostics: str,
+    cppref=False,
+) -> HighlightedCode:
     highlighted = HighlightedCode(
         filename=filename,
         code=code,
-        tokens=tokens,
-        diagnostics=result.stderr.decode("utf8"),
+        tokens=data["tokens"],
+        diagnostics=diagnostics,
+        degraded=data.get("degraded", False),
+        mismatches=data["mismatches"],
+        stats=data.get("stats"),
+        configurations=data.get("configurations", []),
     )
 
     for p in postprocessing.ALL:
@@ -120,3 +463,108 @@ def run(
         map_stl.resolve_stl(highlighted)
 
     return highlighted
+
+
+def run_many(
+    filenames: Iterable[Path] = (),
+    codes: Iterable[str] = (),
+    args=["-DNDEBUG", "-std=c++23"],
+    build_dir=None,
+    punctuation="keep",
+    cppref=False,
+    jobs: Optional[int] = None,
+    deadline_ms: Optional[int] = None,
+    keep_going=False,
+    skip_errors=False,
+) -> Iterator[HighlightedCode]:
+    """
+    Highlight many files and/or code snippets in a single clang-highlight
+    process with `jobs` worker processes (default: number of CPUs).
+
+    Results are yielded in order of completion. Files can be identified by
+    their `filename`, snippets have no filename. Diagnostics are not
+    reported per file. Files that could not be highlighted raise a
+    RuntimeError, or are skipped if `skip_errors` is set.
+    """
+
+    filenames = [Path(f) for f in filenames]
+    codes = list(codes)
+    if not filenames and not codes:
+        return
+
+    with tempfile.TemporaryDirectory() as tmp:
+        tmp = Path(tmp)
+
+        # Path passed to clang-highlight -> filename of the result. Batch
+        # results name their input path exactly as it was passed.
+        inputs = {str(f): f for f in filenames}
+        for i, code in enumerate(codes):
+            path = tmp / f"snippet{i}.cpp"
+            path.write_text(code)
+            inputs[str(path)] = None
+
+        paths = list(inputs.keys())
+
+        with build_dir_context(paths, build_dir, args) as ch_build_dir:
+            cmd = [
+                _ch,
+                "-p",
+                ch_build_dir,
+                *_options(punctuation, deadline_ms, keep_going),
+                f"--jobs={jobs or os.cpu_count()}",
+                *paths,
+            ]
+
+            # Written to a file, so that we never block on a full pipe
+            with open(tmp / "stderr.txt", "w+b") as stderr:
+                proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=stderr)
+
+                def failed():
+                    stderr.seek(0)
+                    return RuntimeError(
+                        "clang-highlight failed. stderr:\n"
+                        + stderr.read().decode("utf8")
+                    )
+
+                try:
+                    # A single file is not processed in batch mode, so a
+                    # failure is only reported by the exit code
+                    if len(paths) == 1:
+                        output = proc.stdout.read()
+                        if proc.wait() != 0:
+                            if skip_errors:
+                                return
+                            raise failed()
+                        outputs = [output]
+                    else:
+                        outputs = proc.stdout
+
+                    done = 0
+                    for line in outputs:
+                        data = json.loads(line)
+                        done += 1
+
+                        if "error" in data and skip_errors:
+                            continue
+                        data = _parse_json(data)
+
+                        path = data.get("input", paths[0])
+                        with open(path, "rb") as f:
+                            code = f.read()
+
+                        yield _highlighted(
+                            data,
+                            filename=inputs[path],
+                            code=code,
+                            diagnostics="",
+                            cppref=cppref,
+                        )
+
+                    proc.wait()
+                    if done < len(paths):
+                        raise failed()
+                finally:
+                    if proc.poll() is None:
+                        proc.kill()
+                    proc.wait()
+                    proc.stdout.close()
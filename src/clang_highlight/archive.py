@@ -0,0 +1,107 @@
+import mmap
+import os
+import struct
+from pathlib import Path
+from typing import Iterator, Union
+
+from .data import HighlightedCode
+
+MAGIC = b"CHARCHV1"
+INDEX_MAGIC = b"CHINDEX1"
+
+# path offset, path size, JSON offset, JSON size
+_ENTRY = struct.Struct("<4Q")
+
+# index offset, number of files, magic
+_FOOTER = struct.Struct("<2Q8s")
+
+
+class Archive:
+    """
+    Reader for archives written by `clang-highlight --archive=FILE`.
+
+    The archive is memory-mapped, so opening it and looking up a single file
+    does not read the results of the other files.
+    """
+
+    def __init__(self, path: Path):
+        with open(path, "rb") as f:
+            self._mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        if len(self._mm) < len(MAGIC) + _FOOTER.size or self._mm[:8] != MAGIC:
+            self._mm.close()
+            raise ValueError(f"{path} is not a clang-highlight archive")
+
+        self._index, self._count, magic = _FOOTER.unpack_from(
+            self._mm, len(self._mm) - _FOOTER.size
+        )
+        if magic != INDEX_MAGIC:
+            self._mm.close()
+            raise ValueError(f"{path} is incomplete")
+
+    def close(self):
+        self._mm.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __len__(self) -> int:
+        return self._count
+
+    def _entry(self, i: int):
+        return _ENTRY.unpack_from(self._mm, self._index + i * _ENTRY.size)
+
+    def _path(self, i: int) -> bytes:
+        offset, size, _, _ = self._entry(i)
+        return self._mm[offset : offset + size]
+
+    def _find(self, path: Union[str, Path]) -> int:
+        # Same normalization as the writer
+        key = os.fsencode(os.path.abspath(path))
+
+        lo, hi = 0, self._count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._path(mid) < key:
+                lo = mid + 1
+            else:
+                hi = mid
+
+        if lo == self._count or self._path(lo) != key:
+            raise KeyError(path)
+        return lo
+
+    def __contains__(self, path: Union[str, Path]) -> bool:
+        try:
+            self._find(path)
+            return True
+        except KeyError:
+            return False
+
+    def __iter__(self) -> Iterator[Path]:
+        for i in range(self._count):
+            yield Path(os.fsdecode(self._path(i)))
+
+    def raw(self, path: Union[str, Path]) -> bytes:
+        """Encoded result of a single file (JSON or compact)"""
+        _, _, offset, size = self._entry(self._find(path))
+        return self._mm[offset : offset + size]
+
+    def load(self, path: Union[str, Path], cppref=False) -> HighlightedCode:
+        """
+        Highlighting result of a single file. The source code is read from
+        disk, so it needs to be unchanged since the archive was written.
+        """
+        from . import _decode
+
+        raw = self.raw(path)
+
+        with open(path, "rb") as f:
+            code = f.read()
+
+        return _decode(
+            raw, filename=Path(path), code=code, diagnostics="", cppref=cppref
+        )
@@ -0,0 +1,138 @@
+"""
+Decoder for the compact binary encoding (`clang-highlight --format=compact`).
+See dumpCompact() in clang_highlight.cpp for the layout.
+"""
+
+from pathlib import Path
+from typing import Any, Dict
+
+from .data import Link, Mismatch, Token, TokenType
+
+MAGIC = b"CHTK\x01"
+
+# In order of ResultToken::Type
+TYPES = [
+    TokenType.WHITESPACE,
+    TokenType.KEYWORD,
+    TokenType.NAME,
+    TokenType.STRING_LITERAL,
+    TokenType.NUMBER_LITERAL,
+    TokenType.OTHER_LITERAL,
+    TokenType.OPERATOR,
+    TokenType.PUNCTUATION,
+    TokenType.COMMENT,
+    TokenType.PREPROCESSOR,
+    TokenType.VARIABLE,
+    TokenType.OTHER,
+]
+
+
+def is_compact(data: bytes) -> bool:
+    return data[: len(MAGIC)] == MAGIC
+
+
+def decode(data: bytes) -> Dict[str, Any]:
+    """
+    Decode a compact result. Returns the same keys as the JSON output, but
+    with Token & Mismatch instances instead of plain dicts. Tokens linking
+    to the same declaration share their Link instance.
+    """
+
+    if not is_compact(data):
+        raise ValueError("not a compact clang-highlight result")
+
+    view = memoryview(data)
+    try:
+        return _decode(view)
+    except IndexError:
+        # A string, link or type index out of range
+        raise ValueError("corrupt compact clang-highlight result") from None
+    finally:
+        # Otherwise a memory-mapped result cannot be closed afterwards
+        view.release()
+
+
+def _decode(data: memoryview) -> Dict[str, Any]:
+    pos = len(MAGIC)
+
+    def varint() -> int:
+        nonlocal pos
+        value = 0
+        shift = 0
+        while True:
+            if pos >= len(data):
+                raise ValueError("truncated compact clang-highlight result")
+            b = data[pos]
+            pos += 1
+            value |= (b & 0x7F) << shift
+            if b < 0x80:
+                return value
+            shift += 7
+
+    def string() -> str:
+        nonlocal pos
+        size = varint()
+        if pos + size > len(data):
+            raise ValueError("truncated compact clang-highlight result")
+        s = str(data[pos : pos + size], "utf8")
+        pos += size
+        return s
+
+    flags = varint()
+    file = string()
+    strings = [string() for _ in range(varint())]
+
+    paths = {}
+    links = []
+    for _ in range(varint()):
+        link_file = varint()
+        if link_file not in paths:
+            paths[link_file] = Path(strings[link_file])
+        line = varint()
+        column = varint()
+        name = strings[varint()]
+        qualified_name = strings[varint()]
+        params = [strings[varint()] for _ in range(varint())]
+        links.append(
+            Link(
+                file=paths[link_file],
+                line=line,
+                column=column,
+                name=name,
+                qualified_name=qualified_name,
+                parameter_types=params or None,
+                cppref=None,
+            )
+        )
+
+    mismatches = []
+    for _ in range(varint()):
+        kind = strings[varint()]
+        mismatches.append(
+            Mismatch(kind=kind, offset=varint(), line=varint(), column=varint())
+        )
+
+    tokens = []
+    end = 0
+    for _ in range(varint()):
+        delta = varint()
+        offset = end + ((delta >> 1) ^ -(delta & 1))
+        packed = varint()
+        length = packed >> 5
+        link = links[varint()] if packed & 1 else None
+        tokens.append(
+            Token(
+                offset=offset,
+                length=length,
+                type=TYPES[(packed >> 1) & 0xF],
+                link=link,
+            )
+        )
+        end = offset + length
+
+    return {
+        "file": file,
+        "degraded": bool(flags & 1),
+        "mismatches": mismatches,
+        "tokens": tokens,
+    }
@@ -1,11 +1,18 @@
-from dataclasses import dataclass
-from typing import Optional, List, Iterable, Tuple
+from bisect import bisect_left, bisect_right
+from dataclasses import dataclass, field
+from typing import Any, Optional, List, Iterable, Tuple, Dict
 from enum import Enum
 from pathlib import Path
 
 
-@dataclass
+@dataclass(slots=True)
 class Link:
+    """
+    Target of a token's link. Tokens linking to the same declaration share
+    one instance, so modifying a link (e.g. setting `cppref`) changes it for
+    all of them.
+    """
+
     file: Path
     line: int
     column: int
@@ -33,7 +40,19 @@ class TokenType(Enum):
     OTHER = "other"
 
 
-@dataclass
+@dataclass(slots=True)
+class Variant:
+    """
+    How a token was highlighted in another configuration, if that differs
+    (see `HighlightedCode.configurations`).
+    """
+
+    configuration: int
+    type: TokenType
+    link: Optional[Link] = None
+
+
+@dataclass(slots=True)
 class Token:
     """
     A single token representing a code fragment with semantic meaning.
@@ -46,11 +65,35 @@ class Token:
 
     link: Optional[Link] = None
 
+    # Only if highlighted in multiple configurations
+    variants: Optional[List[Variant]] = None
+
+
+@dataclass(slots=True)
+class Mismatch:
+    """
+    A token clang-highlight expected to find, but did not. Only reported if
+    `keep_going` is set.
+    """
+
+    kind: str
+    offset: int
+    line: int
+    column: int
+
+    # Index into `HighlightedCode.configurations`, if there are several
+    configuration: Optional[int] = None
+
 
 @dataclass
 class HighlightedCode:
     """
     Code with highlighting information
+
+    Lookups by offset (token_at(), tokens_in_range(), iter_range()) use an
+    index of the token offsets. To change tokens, assign a new list to
+    `tokens` (like the postprocessing passes do), or at least change its
+    length: replacing tokens in place is not detected.
     """
 
     filename: Path
@@ -58,6 +101,117 @@ class HighlightedCode:
     tokens: List[Token]
     diagnostics: str
 
+    # True if the deadline was exceeded and we only have lexical tokens
+    degraded: bool = False
+
+    mismatches: List[Mismatch] = field(default_factory=list)
+
+    # Processing statistics (only if requested). The "phases" entry maps each
+    # phase to its wall time and hardware counters, if available.
+    stats: Optional[Dict[str, Any]] = None
+
+    # Command line of each configuration, if highlighted with all_configs.
+    # Tokens carry the first link found in any configuration, and list the
+    # configurations in which they differ as variants.
+    configurations: List[str] = field(default_factory=list)
+
+    # Lazily built indexes. They are rebuilt if code or tokens are replaced
+    # (or tokens changes its length), but not if tokens is edited in place.
+    _token_index: Optional[Tuple[List[Token], int, List[int]]] = field(
+        default=None, init=False, repr=False, compare=False
+    )
+    _line_index: Optional[Tuple[bytes, List[int]]] = field(
+        default=None, init=False, repr=False, compare=False
+    )
+
+    def _token_offsets(self) -> List[int]:
+        index = self._token_index
+        if index is None or index[0] is not self.tokens or index[1] != len(self.tokens):
+            offsets = [t.offset for t in self.tokens]
+            self._token_index = index = (self.tokens, len(self.tokens), offsets)
+
+        return index[2]
+
+    @property
+    def line_starts(self) -> List[int]:
+        """Byte offset of the start of each line"""
+        index = self._line_index
+        if index is None or index[0] is not self.code:
+            starts = [0]
+            pos = self.code.find(b"\n")
+            while pos != -1:
+                starts.append(pos + 1)
+                pos = self.code.find(b"\n", pos + 1)
+            self._line_index = index = (self.code, starts)
+
+        return index[1]
+
+    def line_of(self, offset: int) -> int:
+        """Line number (starting at 1) of a byte offset"""
+        return bisect_right(self.line_starts, offset)
+
+    def line_range(self, first: int, last: int) -> Tuple[int, int]:
+        """Byte range of the lines first to last (inclusive, starting at 1)"""
+        if not 1 <= first <= last:
+            raise ValueError(f"invalid line range {first} to {last}")
+
+        starts = self.line_starts
+        begin = starts[first - 1] if first <= len(starts) else len(self.code)
+        end = starts[last] if last < len(starts) else len(self.code)
+        return begin, end
+
+    def token_at(self, offset: int) -> Optional[Token]:
+        """Token containing a byte offset, if any"""
+        i = bisect_right(self._token_offsets(), offset) - 1
+        if i >= 0:
+            token = self.tokens[i]
+            if offset < token.offset + token.length:
+                return token
+
+        return None
+
+    def tokens_in_range(self, begin: int, end: int) -> List[Token]:
+        """Tokens overlapping the byte range [begin, end)"""
+        offsets = self._token_offsets()
+
+        first = bisect_right(offsets, begin) - 1
+        if first < 0:
+            first = 0
+        elif self.tokens[first].offset + self.tokens[first].length <= begin:
+            first += 1
+
+        return self.tokens[first : bisect_left(offsets, end)]
+
+    def iter_range(
+        self, begin: int, end: int
+    ) -> Iterable[Tuple[str, Optional[Token]]]:
+        """
+        Like iterating over the whole code, but only the byte range
+        [begin, end) is decoded. Tokens crossing the range boundaries are
+        cut off. The boundaries need to be on UTF-8 character boundaries.
+        """
+
+        offset = begin
+        for token in self.tokens_in_range(begin, end):
+            token_begin = max(token.offset, begin)
+            token_end = min(token.offset + token.length, end)
+
+            if token_begin > offset:
+                yield self.code[offset:token_begin].decode("utf8"), None
+
+            yield self.code[token_begin:token_end].decode("utf8"), token
+
+            offset = token_end
+
+        if offset < end:
+            yield self.code[offset:end].decode("utf8"), None
+
+    def iter_lines(
+        self, first: int, last: int
+    ) -> Iterable[Tuple[str, Optional[Token]]]:
+        """iter_range() over the lines first to last (inclusive, starting at 1)"""
+        return self.iter_range(*self.line_range(first, last))
+
     def __iter__(self) -> Iterable[Tuple[str, Optional[Token]]]:
         """
         Iterate over the tokenized code. Yields each text fragment and its
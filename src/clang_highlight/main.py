@@ -23,12 +23,34 @@ def main():
         default="html",
     )
     parser.add_argument("--cppref", action=argparse.BooleanOptionalAction)
+    parser.add_argument(
+        "--deadline-ms",
+        type=int,
+        help="Fall back to lexical highlighting if parsing takes longer",
+        metavar="MS",
+    )
+    parser.add_argument(
+        "--keep-going",
+        action="store_true",
+        help="Report tokens that could not be found instead of failing",
+    )
+    parser.add_argument(
+        "--ast-cache",
+        type=Path,
+        help="Directory for saved ASTs, which are re-used if still up to date",
+        metavar="DIR",
+    )
     parser.add_argument("file", type=Path, help="Source file")
 
     args = parser.parse_args()
 
     highlighted = clang_highlight.run(
-        filename=args.file, build_dir=args.p, cppref=args.cppref
+        filename=args.file,
+        build_dir=args.p,
+        cppref=args.cppref,
+        deadline_ms=args.deadline_ms,
+        keep_going=args.keep_going,
+        ast_cache=args.ast_cache,
     )
 
     formatter = FORMATTERS[args.format]
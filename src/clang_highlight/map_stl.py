@@ -3,6 +3,7 @@ Maps from declarations of STL functions to their documentation on
 cppreference.com.
 """
 
+import os
 import subprocess
 from pathlib import Path
 import xml.etree.ElementTree as ET
@@ -12,18 +13,28 @@ import json
 import lxml.html
 import sys
 import dataclasses
-from multiprocessing.pool import ThreadPool
 from urllib.parse import quote
+from typing import Any, Iterable, Iterator, List, Tuple
+from concurrent.futures import ProcessPoolExecutor, ThreadPoolExecutor
 
 import requests
 import shutil
 import functools
+import hashlib
+import itertools
+import multiprocessing
+import threading
 from tqdm import tqdm
 
-from .data import TokenType, HighlightedCode, Link
+from .data import TokenType, HighlightedCode
+from . import stl_index
+from .stl_index import StlIndex
 import clang_highlight
 
 CACHE_FILE = Path.home() / ".cache" / "clang_highlight_stl.json"
+CACHE_INDEX = Path.home() / ".cache" / "clang_highlight_stl.idx"
+# What the map was built from, checked without loading the whole map
+CACHE_STAMP = Path.home() / ".cache" / "clang_highlight_stl.stamp"
 DOWNLOAD_URL = "https://github.com/PeterFeicht/cppreference-doc/releases/download/v20241110/cppreference-doc-20241110.tar.xz"
 
 header_regex = re.compile(r"header(=|\|)(?P<header>[^|}]+)(\||\})")
@@ -239,16 +250,67 @@ def generate_template_args(params, exclude=set(), decl=""):
     return f"<{','.join(args)}>", typedefs, parameter_set
 
 
-def handle_class(cls: ET.Element, reference_base: Path, out_base: Path):
+def _hash(data: bytes) -> str:
+    return hashlib.sha256(data).hexdigest()
+
+
+def read_input(reference_base: Path, page: str, inputs: dict) -> str:
+    """Read a reference page and record its hash in inputs"""
+    try:
+        data = (reference_base / f"{page}.html").read_bytes()
+    except FileNotFoundError:
+        inputs[page] = None
+        raise
+
+    inputs[page] = _hash(data)
+    return data.decode()
+
+
+def inputs_changed(cls: ET.Element, reference_base: Path, inputs: dict) -> bool:
+    """Did anything handle_class() read for cls change since it was recorded?"""
+    for page, digest in inputs.items():
+        if page == "<generated>":
+            # Only known after generating again (see work())
+            continue
+        elif page == "<index>":
+            current = _hash(ET.tostring(cls))
+        else:
+            try:
+                current = _hash((reference_base / f"{page}.html").read_bytes())
+            except FileNotFoundError:
+                current = None
+
+        if current != digest:
+            return True
+
+    return False
+
+
+def generate_class(cls: ET.Element, reference_base: Path, out_base: Path):
+    """handle_class() for a worker process, returns the file and the inputs"""
+    inputs = {}
+    path = handle_class(cls, reference_base, out_base, inputs)
+    inputs["<generated>"] = _hash(path.read_bytes()) if path else None
+    return path, inputs
+
+
+def handle_class(cls: ET.Element, reference_base: Path, out_base: Path, inputs: dict):
+    """
+    Generate a file calling all functions of cls. The hashes of everything
+    this depends on are recorded in inputs (see inputs_changed()).
+    """
+
     pages = {}
     functions = {}
 
+    inputs["<index>"] = _hash(ET.tostring(cls))
+
     if "/experimental/" in cls.attrib["link"]:
         return
 
     try:
         class_tree = lxml.html.fromstring(
-            open(reference_base / f"{cls.attrib['link']}.html").read()
+            read_input(reference_base, cls.attrib["link"], inputs)
         )
     except FileNotFoundError:
         return
@@ -293,9 +355,7 @@ def handle_class(cls: ET.Element, reference_base: Path, out_base: Path):
 
     for page, page_overloads in sorted(pages.items()):
         try:
-            page_tree = lxml.html.fromstring(
-                open(reference_base / f"{page}.html").read()
-            )
+            page_tree = lxml.html.fromstring(read_input(reference_base, page, inputs))
         except FileNotFoundError:
             print(f"Warning: Page {page} not found", file=sys.stderr)
             continue
@@ -477,8 +537,10 @@ using MyType = {cls_type};
 
 
 def process_file(path: Path):
-    highlighted = clang_highlight.run(filename=path)
+    return extract_calls(clang_highlight.run(filename=path))
+
 
+def extract_calls(highlighted: HighlightedCode):
     ret = []
     num_page_comments = 0
     take_next = False
@@ -511,6 +573,120 @@ def process_file(path: Path):
     return ret, (num_page_comments - len(ret))
 
 
+class CallResolver:
+    """
+    Highlights generated call files (see process_file()) in batches, while
+    more files are still being generated. Each batch is a single
+    clang-highlight process, and all batches share a precompiled header of
+    the standard library.
+    """
+
+    BATCH_SIZE = 64
+    ARGS = ["-DNDEBUG", "-std=c++23"]
+
+    def __init__(self, workdir: Path, std_headers: Iterable[str], jobs: int):
+        self.workdir = workdir
+        self.jobs = jobs
+        self.pch = workdir / "stl_prelude.pch"
+        self.batches = []
+        self.pending = []
+
+        # Batches run one after another, but in parallel to the generation
+        self.executor = ThreadPoolExecutor(max_workers=1)
+        self.have_pch = self.executor.submit(self._build_pch, sorted(std_headers))
+
+    def _write_commands(self, directory: Path, commands: List[Tuple[List[str], Path]]):
+        directory.mkdir(exist_ok=True)
+        with open(directory / "compile_commands.json", "w") as f:
+            json.dump(
+                [
+                    {
+                        "directory": str(self.workdir),
+                        "command": " ".join(["/usr/bin/c++", *args, str(path)]),
+                        "file": str(path),
+                    }
+                    for args, path in commands
+                ],
+                f,
+            )
+
+    def _build_pch(self, std_headers: List[str]) -> bool:
+        # Same prologue as the generated files
+        prelude = self.workdir / "stl_prelude.hpp"
+        prelude.write_text(
+            "#define static_assert(...)\n"
+            + "".join(f"#include {h}\n" for h in std_headers)
+        )
+
+        directory = self.workdir / "pch"
+        self._write_commands(directory, [(["-x", "c++-header", *self.ARGS], prelude)])
+
+        result = subprocess.run(
+            [
+                clang_highlight._ch,
+                "-p",
+                directory,
+                f"--generate-pch={self.pch}",
+                prelude,
+            ],
+            stderr=subprocess.PIPE,
+            text=True,
+        )
+        if result.returncode != 0:
+            # Everything still works, but each file parses the whole STL
+            print(
+                f"Warning: Could not build STL prelude PCH:\n{result.stderr}",
+                file=sys.stderr,
+            )
+        return result.returncode == 0
+
+    def _process(self, num: int, batch: List[Tuple[Any, Path]]):
+        args = list(self.ARGS)
+        if self.have_pch.result():
+            args += ["-include-pch", str(self.pch)]
+
+        directory = self.workdir / f"batch{num}"
+        self._write_commands(directory, [(args, path) for _, path in batch])
+
+        # Files that fail are missing from the results
+        highlighted = clang_highlight.run_many(
+            [path.absolute() for _, path in batch],
+            build_dir=directory,
+            jobs=self.jobs,
+            skip_errors=True,
+        )
+        calls = {h.filename: extract_calls(h) for h in highlighted}
+
+        return [
+            (
+                key,
+                calls.get(path.absolute())
+                or ([], path.read_text().count("// PAGE: ")),
+            )
+            for key, path in batch
+        ]
+
+    def add(self, key: Any, path: Path):
+        self.pending.append((key, path))
+        if len(self.pending) >= self.BATCH_SIZE:
+            self.flush()
+
+    def flush(self):
+        if self.pending:
+            self.batches.append(
+                self.executor.submit(self._process, len(self.batches), self.pending)
+            )
+            self.pending = []
+
+    def results(self) -> Iterator[Tuple[Any, Tuple[list, int]]]:
+        """Wait for all added files, yields (key, process_file() result)"""
+        self.flush()
+        for batch in tqdm(self.batches):
+            yield from batch.result()
+
+        self.executor.shutdown()
+
+
 def get_symbols(index: ET.ElementTree):
     symbols = {}
 
@@ -590,6 +766,49 @@ def get_headers(reference_base: Path):
     return include_to_link
 
 
+# Reports the version of the standard library as a warning
+STDLIB_VERSION_CODE = """
+#include <version>
+#define CH_STR(x) #x
+#define CH_XSTR(x) CH_STR(x)
+#if defined(_LIBCPP_VERSION)
+#pragma message("stdlib version: libc++ " CH_XSTR(_LIBCPP_VERSION))
+#elif defined(__GLIBCXX__)
+#pragma message("stdlib version: libstdc++ " CH_XSTR(__GLIBCXX__))
+#endif
+"""
+
+
+def toolchain_version(headers: Iterable[str]) -> str:
+    """
+    Identifies clang, the standard library and this generator, which the map
+    depends on. headers are the header files found by get_headers().
+    """
+    version = subprocess.run(
+        [clang_highlight._ch, "--version"],
+        stdout=subprocess.PIPE,
+        check=True,
+        text=True,
+    ).stdout
+
+    # Patch releases of the standard library may leave the paths (and even
+    # the top-level headers) alone, but they bump the version macro
+    diagnostics = clang_highlight.run(code=STDLIB_VERSION_CODE).diagnostics
+    stdlib = re.findall(r"stdlib version: \S+ \S+", diagnostics)
+
+    digest = hashlib.sha256()
+    digest.update(version.encode())
+    digest.update("\n".join(stdlib).encode())
+    for header in sorted(headers):
+        digest.update(header.encode())
+        try:
+            digest.update(Path(header).read_bytes())
+        except OSError:
+            pass
+    digest.update(Path(__file__).read_bytes())
+    return digest.hexdigest()
+
+
 def work(workdir: Path):
     archive_path = workdir / "cppreference.tar.xz"
 
@@ -642,32 +861,84 @@ def work(workdir: Path):
     out_base = workdir / "stl_calls"
     out_base.mkdir(exist_ok=True)
 
-    print("\nGenerating STL calls...\n", file=sys.stderr)
-    files = []
+    # Re-use the results for classes whose inputs did not change
+    toolchain = toolchain_version(headers)
+    previous = {}
+    if CACHE_FILE.exists():
+        with open(CACHE_FILE) as f:
+            old_map = json.load(f)
+        if old_map.get("toolchain") == toolchain:
+            previous = old_map.get("classes", {})
+
+    classes = {}
+    changed = []
     for cls in tree.findall("class"):
-        f = handle_class(cls, reference_base, out_base)
-        if f:
-            files.append(f)
+        link = cls.attrib["link"]
+
+        old = previous.get(link)
+        if old is not None and not inputs_changed(cls, reference_base, old["inputs"]):
+            classes[link] = old
+        else:
+            changed.append(cls)
+
+    print(
+        f"\nGenerating & resolving STL calls for {len(changed)} changed classes...",
+        file=sys.stderr,
+    )
 
-    print("\nResolving STL calls...", file=sys.stderr)
-    pool = ThreadPool()
-    result = list(tqdm(pool.imap(lambda x: process_file(x), files), total=len(files)))
+    # Pages are parsed in parallel, and each generated file is highlighted
+    # as soon as enough of them are ready. Both stages share the CPUs.
+    cpus = os.cpu_count() or 1
+    parse_jobs = max(1, cpus // 2)
+    highlight_jobs = max(1, cpus - parse_jobs)
+
+    std_headers = {f"<{page.removeprefix('cpp/header/')}>" for page in headers.values()}
+    resolver = CallResolver(workdir, std_headers, jobs=highlight_jobs)
+
+    # The resolver runs clang-highlight from a thread, so forking this process
+    # for the parsers could copy locks held by that thread
+    forkserver = multiprocessing.get_context("forkserver")
+    with ProcessPoolExecutor(max_workers=parse_jobs, mp_context=forkserver) as pool:
+        generated = pool.map(
+            generate_class,
+            changed,
+            itertools.repeat(reference_base),
+            itertools.repeat(out_base),
+            chunksize=8,
+        )
+        for cls, (path, inputs) in zip(changed, generated):
+            link = cls.attrib["link"]
+
+            # A changed page does not necessarily change the generated calls
+            old = previous.get(link)
+            if old is not None and old["inputs"].get("<generated>") == (
+                inputs["<generated>"]
+            ):
+                classes[link] = {**old, "inputs": inputs}
+                continue
 
-    result = list(zip(files, result))
-    result = sorted(result, key=lambda x: x[1][1])
+            classes[link] = {"inputs": inputs, "calls": [], "failures": 0}
+            if path:
+                resolver.add(link, path)
 
-    print("STL mapping failures per file:", file=sys.stderr)
-    for f, res in result:
-        if res[1] != 0:
-            print(f, res[1], file=sys.stderr)
+    for link, (calls, failures) in resolver.results():
+        classes[link]["calls"] = calls
+        classes[link]["failures"] = failures
 
-    print(f"Failures in total: {sum([res[1][1] for res in result])}", file=sys.stderr)
+    print("STL mapping failures per class:", file=sys.stderr)
+    for link, info in sorted(classes.items(), key=lambda x: x[1]["failures"]):
+        if info["failures"] != 0:
+            print(link, info["failures"], file=sys.stderr)
+
+    print(
+        f"Failures in total: {sum(info['failures'] for info in classes.values())}",
+        file=sys.stderr,
+    )
 
     functions = {}
-    for f, res in result:
-        infos = res[0]
-        for info in infos:
-            functions.setdefault(info["overload"]["qualified_name"], []).append(info)
+    for info in classes.values():
+        for call in info["calls"]:
+            functions.setdefault(call["overload"]["qualified_name"], []).append(call)
 
     def serialize_path(p):
         if isinstance(p, Path):
@@ -677,31 +948,81 @@ def work(workdir: Path):
 
     with open(CACHE_FILE, "w") as f:
         json.dump(
-            {"symbols": symbols, "overloads": functions, "headers": headers},
+            {
+                "symbols": symbols,
+                "overloads": functions,
+                "headers": headers,
+                "toolchain": toolchain,
+                "classes": classes,
+            },
             f,
             indent=2,
             default=serialize_path,
         )
 
+    CACHE_STAMP.write_text(
+        json.dumps(
+            {
+                "reference": DOWNLOAD_URL,
+                "toolchain": toolchain,
+                "headers": sorted(headers),
+            }
+        )
+    )
+
 
-def overload_match(overload: dict, link: Link):
-    if overload["qualified_name"] != link.qualified_name:
-        return False
+def stl_map_outdated() -> bool:
+    """
+    Was the cached map built from another cppreference release or another
+    toolchain? Changed pages within a release are only found by work().
+    """
+    try:
+        stamp = json.loads(CACHE_STAMP.read_text())
+    except (OSError, ValueError):
+        return True
 
-    if overload["parameter_types"] != link.parameter_types:
-        return False
+    if stamp.get("reference") != DOWNLOAD_URL:
+        return True
+    return stamp.get("toolchain") != toolchain_version(stamp.get("headers", []))
 
-    return True
 
+# Results may be decoded in several threads at once (see run_async())
+_stl_map_lock = threading.Lock()
 
-def resolve_stl(highlighted: HighlightedCode):
-    if not CACHE_FILE.exists():
+
+def load_stl_map() -> StlIndex:
+    """
+    Open the lookup table for the STL map, generating the map first if
+    necessary. The table is only opened once per process and read lazily.
+    """
+    with _stl_map_lock:
+        return _load_stl_map()
+
+
+@functools.cache
+def _load_stl_map() -> StlIndex:
+    # Regenerating only redoes the classes whose inputs changed
+    if not CACHE_FILE.exists() or stl_map_outdated():
         with tempfile.TemporaryDirectory(prefix="stl_map") as workdir:
             work(Path(workdir))
 
-    # Load STL map
-    with open(Path.home() / ".cache" / "clang_highlight_stl.json") as f:
+    try:
+        index = StlIndex(CACHE_INDEX)
+        if index.is_current(CACHE_FILE):
+            return index
+    except (OSError, ValueError):
+        pass
+
+    # (Re-)build the table from the JSON map
+    with open(CACHE_FILE) as f:
         stl_map = json.load(f)
+    stl_index.write(stl_map, CACHE_FILE, CACHE_INDEX)
+
+    return StlIndex(CACHE_INDEX)
+
+
+def resolve_stl(highlighted: HighlightedCode):
+    index = load_stl_map()
 
     # Resolve STL tokens
     for tok in highlighted.tokens:
@@ -711,19 +1032,15 @@ def resolve_stl(highlighted: HighlightedCode):
         link = tok.link
 
         # First try: non-overloaded symbols
-        page = stl_map["symbols"].get(link.qualified_name)
+        page = index.symbol(link.qualified_name)
 
         # Second try: some overload
         if page is None and link.parameter_types is not None:
-            overloads = stl_map["overloads"].get(tok.link.qualified_name)
-            if overloads is not None:
-                matching = [o for o in overloads if overload_match(o["overload"], link)]
-                if matching:
-                    page = matching[0]["page"]
+            page = index.overload(link.qualified_name, link.parameter_types)
 
         # Is this a header?
         if link.name == "<file>":
-            page = stl_map["headers"].get(str(link.file))
+            page = index.header(str(link.file))
 
         if page is not None:
             link.cppref = page
@@ -2,7 +2,7 @@
 The output formats clang-highlight supports.
 """
 
-from .data import HighlightedCode, TokenType
+from .data import HighlightedCode, Link, TokenType
 from typing import TextIO
 from html import escape as html_escape
 import dataclasses
@@ -27,33 +27,63 @@ TOKEN_TYPE_TO_CSS_CLASS = {
 }
 
 
+def _link_href(link: Link) -> str:
+    if link.cppref:
+        return f"https://en.cppreference.com/w/{link.cppref}"
+    elif link.line != 0:
+        return f"{link.file}#L{link.line}"
+    else:
+        return f"{link.file}"
+
+
+# Fragments are written in chunks of this many strings
+HTML_CHUNK_SIZE = 4096
+
+
 def html_embed(code: HighlightedCode, f: TextIO):
-    f.write('<pre class="m-code">')
+    parts = ['<pre class="m-code">']
+    append = parts.append
+
+    # Opening & closing markup per type and link target (see _link_href())
+    markup = {}
+
+    # Most fragments (whitespace, punctuation, names) occur many times
+    escaped = {}
 
     for text, token in code:
         if token:
-            css = TOKEN_TYPE_TO_CSS_CLASS[token.type]
-            f.write(f'<span class="{css}">')
-
-            if token.link:
-                if token.link.cppref:
-                    f.write(
-                        f'<a href="https://en.cppreference.com/w/{token.link.cppref}">'
-                    )
+            link = token.link
+            if link:
+                key = (token.type, link.cppref, link.file, link.line)
+            else:
+                key = token.type
+            tags = markup.get(key)
+            if tags is None:
+                css = TOKEN_TYPE_TO_CSS_CLASS[token.type]
+                if link:
+                    href = _link_href(link)
+                    tags = (f'<span class="{css}"><a href="{href}">', "</a></span>")
                 else:
-                    if token.link.line != 0:
-                        f.write(f'<a href="{token.link.file}#L{token.link.line}">')
-                    else:
-                        f.write(f'<a href="{token.link.file}">')
+                    tags = (f'<span class="{css}">', "</span>")
+                markup[key] = tags
 
-        f.write(html_escape(text))
+        text_html = escaped.get(text)
+        if text_html is None:
+            text_html = escaped[text] = html_escape(text)
 
         if token:
-            if token.link:
-                f.write("</a>")
-            f.write("</span>")
-
-    f.write("</pre>")
+            append(tags[0])
+            append(text_html)
+            append(tags[1])
+        else:
+            append(text_html)
+
+        if len(parts) >= HTML_CHUNK_SIZE:
+            f.write("".join(parts))
+            parts.clear()
+
+    append("</pre>")
+    f.write("".join(parts))
 
 
 def html(code: HighlightedCode, f: TextIO):
@@ -3,6 +3,7 @@ Postprocessing
 """
 
 from .data import Token, TokenType, HighlightedCode
+from typing import Iterable
 import re
 
 INCLUDE_REGEX = re.compile(rb'(?P<stmt>#\s*include)\s*(?P<file>[<"].*[">])')
@@ -14,116 +15,133 @@ ESCAPE_REGEX = re.compile(
 STRING_INTERPOLATION_REGEX = re.compile(rb"\{(?=[^{]).*?\}")
 
 
-def generate_include_file_tokens(h: HighlightedCode):
-    new_tokens = []
-    for tok in h.tokens:
-        if tok.type == TokenType.PREPROCESSOR:
-            text = h.code[tok.offset : tok.offset + tok.length]
-            m = INCLUDE_REGEX.match(text)
-
-            if not m:
-                raise RuntimeError(
-                    f"Could not parse include statement '{text.decode()}'"
-                )
-
-            stmt_begin, stmt_end = m.span("stmt")
-            file_begin, file_end = m.span("file")
-
-            new_tokens.append(
-                Token(
-                    offset=tok.offset + stmt_begin,
-                    length=stmt_end - stmt_begin,
-                    type=TokenType.PREPROCESSOR,
-                )
-            )
-            new_tokens.append(
-                Token(
-                    offset=tok.offset + file_begin,
-                    length=file_end - file_begin,
-                    type=TokenType.PREPROCESSOR_FILE,
-                    link=tok.link,
-                )
-            )
-        else:
-            new_tokens.append(tok)
+def _split_include(h: HighlightedCode, tok: Token) -> Iterable[Token]:
+    text = h.code[tok.offset : tok.offset + tok.length]
+    m = INCLUDE_REGEX.match(text)
 
-    h.tokens = new_tokens
+    if not m:
+        raise RuntimeError(f"Could not parse include statement '{text.decode()}'")
 
+    stmt_begin, stmt_end = m.span("stmt")
+    file_begin, file_end = m.span("file")
 
-def escape_codes(h: HighlightedCode):
-    new_tokens = []
+    return [
+        Token(
+            offset=tok.offset + stmt_begin,
+            length=stmt_end - stmt_begin,
+            type=TokenType.PREPROCESSOR,
+        ),
+        Token(
+            offset=tok.offset + file_begin,
+            length=file_end - file_begin,
+            type=TokenType.PREPROCESSOR_FILE,
+            link=tok.link,
+        ),
+    ]
 
-    for tok in h.tokens:
-        if tok.type != TokenType.STRING_LITERAL:
-            new_tokens.append(tok)
-            continue
 
-        text = h.code[tok.offset : tok.offset + tok.length]
+def _split_string(
+    h: HighlightedCode, tok: Token, regex: re.Pattern, type: TokenType
+) -> Iterable[Token]:
+    text = h.code[tok.offset : tok.offset + tok.length]
 
-        if b'"' not in text:
-            new_tokens.append(tok)
-            continue
+    def insert(begin: int, end: int, type: TokenType):
+        return Token(offset=tok.offset + begin, length=end - begin, type=type)
 
-        prefix, _, _ = text.partition(b'"')
+    pos = 0
+    for m in regex.finditer(text):
+        begin, end = m.span()
+        if begin > pos:
+            yield insert(pos, begin, TokenType.STRING_LITERAL)
 
-        if b"R" in prefix:
-            new_tokens.append(tok)
-            continue
+        yield insert(begin, end, type)
 
-        def insert(begin: int, end: int, type: TokenType):
-            new_tokens.append(
-                Token(offset=tok.offset + begin, length=end - begin, type=type)
-            )
+        pos = end
 
-        pos = 0
-        for m in ESCAPE_REGEX.finditer(text):
-            begin, end = m.span()
-            if begin > pos:
-                insert(pos, begin, TokenType.STRING_LITERAL)
+    if pos < len(text):
+        yield insert(pos, len(text), TokenType.STRING_LITERAL)
 
-            insert(begin, end, TokenType.STRING_LITERAL_ESCAPE)
 
-            pos = end
+def _split_escapes(h: HighlightedCode, tok: Token) -> Iterable[Token]:
+    text = h.code[tok.offset : tok.offset + tok.length]
 
-        if pos < len(text):
-            insert(pos, len(text), TokenType.STRING_LITERAL)
+    if b'"' not in text:
+        return [tok]
 
-    h.tokens = new_tokens
+    prefix, _, _ = text.partition(b'"')
 
+    if b"R" in prefix:
+        return [tok]
+
+    return _split_string(h, tok, ESCAPE_REGEX, TokenType.STRING_LITERAL_ESCAPE)
 
-def string_interpolation(h: HighlightedCode):
-    new_tokens = []
 
+def _split_interpolations(h: HighlightedCode, tok: Token) -> Iterable[Token]:
+    text = h.code[tok.offset : tok.offset + tok.length]
+
+    if b'"' not in text:
+        return [tok]
+
+    return _split_string(
+        h, tok, STRING_INTERPOLATION_REGEX, TokenType.STRING_LITERAL_INTERPOLATION
+    )
+
+
+def generate_include_file_tokens(h: HighlightedCode):
+    new_tokens = []
     for tok in h.tokens:
-        if tok.type != TokenType.STRING_LITERAL:
+        if tok.type == TokenType.PREPROCESSOR:
+            new_tokens += _split_include(h, tok)
+        else:
             new_tokens.append(tok)
-            continue
 
-        text = h.code[tok.offset : tok.offset + tok.length]
+    h.tokens = new_tokens
+
 
-        if b'"' not in text:
+def escape_codes(h: HighlightedCode):
+    new_tokens = []
+    for tok in h.tokens:
+        if tok.type == TokenType.STRING_LITERAL:
+            new_tokens += _split_escapes(h, tok)
+        else:
             new_tokens.append(tok)
-            continue
 
-        def insert(begin: int, end: int, type: TokenType):
-            new_tokens.append(
-                Token(offset=tok.offset + begin, length=end - begin, type=type)
-            )
+    h.tokens = new_tokens
 
-        pos = 0
-        for m in STRING_INTERPOLATION_REGEX.finditer(text):
-            begin, end = m.span()
-            if begin > pos:
-                insert(pos, begin, TokenType.STRING_LITERAL)
 
-            insert(begin, end, TokenType.STRING_LITERAL_INTERPOLATION)
+def string_interpolation(h: HighlightedCode):
+    new_tokens = []
+    for tok in h.tokens:
+        if tok.type == TokenType.STRING_LITERAL:
+            new_tokens += _split_interpolations(h, tok)
+        else:
+            new_tokens.append(tok)
+
+    h.tokens = new_tokens
+
 
-            pos = end
+def all_passes(h: HighlightedCode):
+    """
+    Same result as running generate_include_file_tokens, escape_codes and
+    string_interpolation in turn, but in a single pass over the tokens.
+    """
 
-        if pos < len(text):
-            insert(pos, len(text), TokenType.STRING_LITERAL)
+    new_tokens = []
+    append = new_tokens.append
+    for tok in h.tokens:
+        type = tok.type
+        if type == TokenType.PREPROCESSOR:
+            new_tokens += _split_include(h, tok)
+        elif type == TokenType.STRING_LITERAL:
+            for part in _split_escapes(h, tok):
+                if part.type == TokenType.STRING_LITERAL:
+                    new_tokens += _split_interpolations(h, part)
+                else:
+                    append(part)
+        else:
+            append(tok)
 
     h.tokens = new_tokens
 
 
-ALL = [generate_include_file_tokens, escape_codes, string_interpolation]
+ALL = [all_passes]
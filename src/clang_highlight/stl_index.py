@@ -0,0 +1,152 @@
+"""
+Compact, memory-mapped lookup table for the STL map (see map_stl.py).
+
+The JSON cache contains the full link of each overload. For resolving
+tokens, we only need a few keys, which are stored in a sorted table:
+
+    "CHSTL001"
+    Header: source size, source mtime (ns), number of keys
+    Keys: {key offset, key size, page offset, page size}, sorted by key
+    Strings (keys & interned pages)
+
+All integers are little-endian uint64. Keys are a kind prefix followed by
+NUL-separated fields (see _key()).
+"""
+
+import mmap
+import os
+import struct
+from pathlib import Path
+from typing import Iterable, List, Optional, Tuple
+
+MAGIC = b"CHSTL001"
+
+_HEADER = struct.Struct("<8s3Q")
+_ENTRY = struct.Struct("<4Q")
+
+SYMBOL = b"S"
+OVERLOAD = b"O"
+HEADER = b"H"
+
+
+def _key(kind: bytes, *fields: str) -> bytes:
+    return b"\0".join([kind, *(f.encode() for f in fields)])
+
+
+def overload_key(
+    qualified_name: str, parameter_types: Optional[List[str]]
+) -> bytes:
+    return _key(OVERLOAD, qualified_name, *(parameter_types or []))
+
+
+def _entries(stl_map: dict) -> Iterable[Tuple[bytes, str]]:
+    for name, page in stl_map["symbols"].items():
+        yield _key(SYMBOL, name), page
+
+    for overloads in stl_map["overloads"].values():
+        for o in overloads:
+            overload = o["overload"]
+            yield (
+                overload_key(overload["qualified_name"], overload["parameter_types"]),
+                o["page"],
+            )
+
+    for file, page in stl_map["headers"].items():
+        yield _key(HEADER, file), page
+
+
+def write(stl_map: dict, source: Path, path: Path):
+    """Write the lookup table for the STL map loaded from source"""
+
+    # The first entry wins, as in a linear search
+    table = {}
+    for key, page in _entries(stl_map):
+        table.setdefault(key, page)
+
+    keys = sorted(table)
+
+    st = source.stat()
+    header = _HEADER.pack(MAGIC, st.st_size, st.st_mtime_ns, len(keys))
+
+    strings = bytearray()
+    pages = {}
+    string_base = _HEADER.size + len(keys) * _ENTRY.size
+
+    def intern(s: bytes) -> Tuple[int, int]:
+        offset = string_base + len(strings)
+        strings.extend(s)
+        return offset, len(s)
+
+    entries = bytearray()
+    for key in keys:
+        key_offset, key_size = intern(key)
+
+        page = table[key].encode()
+        if page not in pages:
+            pages[page] = intern(page)
+        page_offset, page_size = pages[page]
+
+        entries += _ENTRY.pack(key_offset, key_size, page_offset, page_size)
+
+    # Replace atomically, other processes might be reading the old one
+    tmp = path.with_suffix(f".{os.getpid()}.tmp")
+    with open(tmp, "wb") as f:
+        f.write(header)
+        f.write(entries)
+        f.write(strings)
+    os.replace(tmp, path)
+
+
+class StlIndex:
+    """Lazily read lookup table written by write()"""
+
+    def __init__(self, path: Path):
+        with open(path, "rb") as f:
+            self._mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        if len(self._mm) < _HEADER.size:
+            raise ValueError(f"{path} is truncated")
+
+        magic, self.source_size, self.source_mtime_ns, self._count = (
+            _HEADER.unpack_from(self._mm)
+        )
+        if magic != MAGIC:
+            raise ValueError(f"{path} is not an STL index")
+
+    def is_current(self, source: Path) -> bool:
+        """True if the index was generated from the current version of source"""
+        st = source.stat()
+        return st.st_size == self.source_size and st.st_mtime_ns == self.source_mtime_ns
+
+    def _entry(self, i: int):
+        return _ENTRY.unpack_from(self._mm, _HEADER.size + i * _ENTRY.size)
+
+    def _key(self, i: int) -> bytes:
+        offset, size, _, _ = self._entry(i)
+        return self._mm[offset : offset + size]
+
+    def lookup(self, key: bytes) -> Optional[str]:
+        lo, hi = 0, self._count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._key(mid) < key:
+                lo = mid + 1
+            else:
+                hi = mid
+
+        if lo == self._count or self._key(lo) != key:
+            return None
+
+        _, _, offset, size = self._entry(lo)
+        return self._mm[offset : offset + size].decode()
+
+    def symbol(self, qualified_name: str) -> Optional[str]:
+        return self.lookup(_key(SYMBOL, qualified_name))
+
+    def overload(
+        self, qualified_name: str, parameter_types: Optional[List[str]]
+    ) -> Optional[str]:
+        return self.lookup(overload_key(qualified_name, parameter_types))
+
+    def header(self, file: str) -> Optional[str]:
+        return self.lookup(_key(HEADER, file))
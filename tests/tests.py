@@ -1,7 +1,17 @@
 import unittest
+import os
+import asyncio
+import dataclasses
+import io
+import tempfile
+import json
+import subprocess
+import time
 import clang_highlight
+from clang_highlight import compact, output, postprocessing
+from pathlib import Path
 from typing import Tuple, Optional
-from clang_highlight import TokenType, Token, HighlightedCode
+from clang_highlight import TokenType, Token, HighlightedCode, Link
 
 
 class CHTests(unittest.TestCase):
@@ -16,9 +26,10 @@ class CHTests(unittest.TestCase):
     ) -> Tuple[str, Optional[Token]]:
         offset = highlighted.code.index(fragment.encode("utf8"))
 
-        for text, token in highlighted:
-            if token and token.offset == offset:
-                return text, token
+        token = highlighted.token_at(offset)
+        if token and token.offset == offset:
+            end = token.offset + token.length
+            return highlighted.code[offset:end].decode("utf8"), token
 
         return None, None
 
@@ -63,6 +74,30 @@ class CHTests(unittest.TestCase):
         self.assertEqual(tok_help.type, TokenType.NAME)
         self.assertEqual(tok_help.link.qualified_name, "std::vector::emplace_back")
 
+    def test_template_inst_elided(self):
+        code = """
+        #include <vector>
+
+        int main(int argc, char** argv)
+        {
+            auto myLambda = [](auto& obj){
+                obj.emplace_back();
+            };
+
+            std::vector<int> v;
+            std::vector<float> w;
+            myLambda(v);
+            myLambda(w);
+        }
+        """
+
+        h = clang_highlight.run(code=code, stats=True)
+
+        _, tok = self.get_token(h, "emplace_back();")
+        self.assertEqual(tok.link.qualified_name, "std::vector::emplace_back")
+        self.assertGreaterEqual(h.stats["elided_instantiation_visits"], 1)
+        self.assertIn("matching", h.stats["phases"])
+
     def test_unspecialize(self):
         code = """
         template<class T>
@@ -190,6 +225,664 @@ class CHTests(unittest.TestCase):
         self.assertTrue(tok.link.file.is_absolute())
         self.assertEqual(tok.link.cppref, "cpp/header/iostream")
 
+    def test_punctuation_linked(self):
+        code = """
+        struct A
+        {
+            A operator+(const A&) const { return *this; }
+        };
+
+        int main()
+        {
+            A a, b;
+            A c = a + b;
+            static_cast<void>(c);
+        }
+        """
+
+        h = clang_highlight.run(code=code, punctuation="linked")
+
+        _, tok = self.get_token(h, "+ b")
+        self.assertEqual(tok.type, TokenType.PUNCTUATION)
+        self.assertEqual(tok.link.qualified_name, "A::operator+")
+
+        for tok in h.tokens:
+            if tok.type == TokenType.PUNCTUATION:
+                self.assertTrue(tok.link is not None)
+
+    def test_ast_cache(self):
+        code = """
+        #include <vector>
+
+        int f(int x) { return x; }
+        int g(int x) { return x; }
+
+        int main(int argc, char** argv)
+        {
+            std::vector<int> v;
+            v.push_back(argc);
+        #ifdef USE_G
+            return g(argc);
+        #else
+            return f(argc);
+        #endif
+        }
+        """
+
+        with (
+            tempfile.TemporaryDirectory() as cache,
+            tempfile.NamedTemporaryFile(mode="w", suffix=".cpp") as f,
+        ):
+            f.write(code)
+            f.flush()
+            cache = Path(cache)
+
+            h1 = clang_highlight.run(filename=Path(f.name), ast_cache=cache)
+            (saved,) = cache.glob("*.ast")
+            mtime = saved.stat().st_mtime_ns
+
+            # Loaded, not parsed & saved again
+            h2 = clang_highlight.run(filename=Path(f.name), ast_cache=cache)
+            self.assertEqual(h1.tokens, h2.tokens)
+            self.assertEqual(saved.stat().st_mtime_ns, mtime)
+
+            _, tok = self.get_token(h2, "push_back")
+            self.assertEqual(tok.link.qualified_name, "std::vector::push_back")
+
+            # Different flags need a different AST
+            h3 = clang_highlight.run(
+                filename=Path(f.name),
+                args=["-DNDEBUG", "-DUSE_G", "-std=c++23"],
+                ast_cache=cache,
+            )
+            self.assertEqual(len(list(cache.glob("*.ast"))), 2)
+
+            _, tok = self.get_token(h3, "g(argc)")
+            self.assertEqual(tok.link.qualified_name, "g")
+            _, tok = self.get_token(h3, "f(argc)")
+            self.assertIsNone(tok.link)
+
+    def test_deadline(self):
+        code = r"""
+        #include <iostream>
+        int main()
+        {
+            return 0;
+        }
+        """
+
+        # Including iostream takes way longer than a millisecond
+        h = clang_highlight.run(code=code, deadline_ms=1)
+        self.assertTrue(h.degraded)
+
+        _, tok = self.get_token(h, "int main")
+        self.assertEqual(tok.type, TokenType.KEYWORD)
+
+        _, tok = self.get_token(h, "main")
+        self.assertEqual(tok.type, TokenType.NAME)
+        self.assertTrue(tok.link is None)
+
+    def test_structured_binding(self):
+        code = """
+        #include <utility>
+        int f(std::pair<int, int> p, int) {
+            auto [a, b] = p;
+            return a + b;
+        }
+        """
+
+        for punctuation in ("keep", "linked", "skip"):
+            h = clang_highlight.run(code=code, punctuation=punctuation)
+
+            _, tok = self.get_token(h, "[a")
+            if punctuation == "keep":
+                self.assertEqual(tok.type, TokenType.PUNCTUATION)
+            else:
+                self.assertIsNone(tok)
+
+            _, tok = self.get_token(h, "a + b")
+            self.assertEqual(tok.link.name, "a")
+
+    def test_keep_going(self):
+        # The expansion of HEADER is swallowed by the token of the include
+        # directive, so there is no token left to annotate
+        code = "#define HEADER <cstddef>\n#include HEADER\nint main() { return 0; }\n"
+
+        h = clang_highlight.run(code=code, keep_going=True)
+        self.assertEqual([m.kind for m in h.mismatches], ["PreprocessedEntity"])
+        self.assertEqual((h.mismatches[0].line, h.mismatches[0].column), (2, 10))
+        self.assertEqual(h.mismatches[0].offset, code.index("HEADER\nint"))
+
+        # Processing continued after the mismatch
+        _, tok = self.get_token(h, "return")
+        self.assertEqual(tok.type, TokenType.KEYWORD)
+
+        # __has_include() takes a header name, but the raw lexer starts a
+        # block comment at "/*" that swallows the declaration of value
+        code = (
+            "#if __has_include(<none/*.h>)\n#endif\n"
+            "int main() { int value = 0; return value; } // */\n"
+        )
+
+        with self.assertRaisesRegex(RuntimeError, "Could not find VarDecl token"):
+            clang_highlight.run(code=code)
+
+        h = clang_highlight.run(code=code, keep_going=True)
+        mismatch = next(m for m in h.mismatches if m.kind == "VarDecl")
+        self.assertEqual(mismatch.offset, code.index("value = 0"))
+        self.assertEqual((mismatch.line, mismatch.column), (3, 18))
+
+    def test_compact(self):
+        code = """
+        #include <vector>
+        // comment
+        int main(int argc, char** argv)
+        {
+            std::vector<int> v;
+            v.push_back(argc);
+            v.push_back(argc + 1);
+            return v.size() > 1 ? 0 : 1;
+        }
+        """
+
+        h_json = clang_highlight.run(code=code)
+        h_compact = clang_highlight.run(code=code, compact=True)
+        self.assertEqual(h_json.tokens, h_compact.tokens)
+
+    def test_compressed(self):
+        code = "#include <map>\nint main() { std::map<int, int> m; m[0] = 1; }\n"
+
+        h = clang_highlight.run(code=code)
+        for compact in (False, True):
+            h_zlib = clang_highlight.run(code=code, compact=compact, compress=True)
+            self.assertEqual(h.tokens, h_zlib.tokens)
+
+    def test_compact_roundtrip(self):
+        code = """
+        #include <string>
+        #define TWICE(x) ((x) + (x))
+        void f(int a, const std::string& b);
+        int main()
+        {
+            std::string s = "text";
+            f(TWICE(1), s);
+        }
+        """
+
+        with tempfile.TemporaryDirectory() as tmp:
+            tmp = Path(tmp)
+            (tmp / "main.cpp").write_text(code)
+
+            def highlight(*options):
+                return subprocess.run(
+                    [clang_highlight._ch, *options, tmp / "main.cpp", "--"]
+                    + ["-std=c++23"],
+                    check=True,
+                    stdout=subprocess.PIPE,
+                ).stdout
+
+            (tmp / "main.chtk").write_bytes(highlight("--format=compact"))
+
+            decoded = subprocess.run(
+                [clang_highlight._ch, "--decode-compact", tmp / "main.chtk", "--"],
+                check=True,
+                stdout=subprocess.PIPE,
+            ).stdout
+            self.assertEqual(json.loads(decoded), json.loads(highlight()))
+
+            # Malformed input is rejected
+            (tmp / "truncated.chtk").write_bytes(
+                (tmp / "main.chtk").read_bytes()[:-1]
+            )
+            p = subprocess.run(
+                [clang_highlight._ch, "--decode-compact", tmp / "truncated.chtk"]
+                + ["--"],
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+            )
+            self.assertNotEqual(p.returncode, 0)
+            self.assertIn(b"truncated", p.stderr)
+
+            # Same for the Python decoder, also with a mapped file
+            with self.assertRaisesRegex(ValueError, "truncated"):
+                compact.decode((tmp / "truncated.chtk").read_bytes())
+            with self.assertRaisesRegex(ValueError, "truncated"):
+                with clang_highlight._mapped_output(tmp / "truncated.chtk") as mm:
+                    compact.decode(mm)
+
+    def test_fused_postprocessing(self):
+        lines = [
+            (b'#include "local.h"', TokenType.PREPROCESSOR),
+            (b"#  include <format>", TokenType.PREPROCESSOR),
+            (b'"{} \\n {{x}} \\x41{}\\""', TokenType.STRING_LITERAL),
+            (b'R"(raw {} \\n)"', TokenType.STRING_LITERAL),
+            (b'u8"\\u00e4 {0:>4}"', TokenType.STRING_LITERAL),
+            (b"'\\n'", TokenType.OTHER_LITERAL),
+            (b"x", TokenType.NAME),
+        ]
+
+        def make():
+            code = b""
+            tokens = []
+            for text, type in lines:
+                tokens.append(Token(offset=len(code), length=len(text), type=type))
+                code += text + b"\n"
+            return HighlightedCode(
+                filename=None, code=code, tokens=tokens, diagnostics=""
+            )
+
+        separate = make()
+        postprocessing.generate_include_file_tokens(separate)
+        postprocessing.escape_codes(separate)
+        postprocessing.string_interpolation(separate)
+
+        fused = make()
+        postprocessing.all_passes(fused)
+
+        self.assertEqual(separate.tokens, fused.tokens)
+        self.assertIn(
+            TokenType.STRING_LITERAL_INTERPOLATION, [t.type for t in fused.tokens]
+        )
+        self.assertIn(TokenType.STRING_LITERAL_ESCAPE, [t.type for t in fused.tokens])
+
+    def test_index(self):
+        code = b"int a;\n// \xc3\xa4\nint b = a;\n"
+        tokens = [
+            Token(offset=0, length=3, type=TokenType.KEYWORD),
+            Token(offset=4, length=1, type=TokenType.NAME),
+            Token(offset=7, length=5, type=TokenType.COMMENT),
+            Token(offset=13, length=3, type=TokenType.KEYWORD),
+            Token(offset=17, length=1, type=TokenType.NAME),
+            Token(offset=21, length=1, type=TokenType.NAME),
+        ]
+        h = HighlightedCode(filename=None, code=code, tokens=tokens, diagnostics="")
+
+        self.assertEqual(h.line_starts, [0, 7, 13, 24])
+        self.assertEqual(h.line_of(8), 2)
+        self.assertIs(h.token_at(2), tokens[0])
+        self.assertIsNone(h.token_at(3))
+        self.assertEqual(h.tokens_in_range(2, 14), tokens[0:4])
+
+        self.assertEqual(
+            list(h.iter_lines(2, 2)),
+            [("// ä", tokens[2]), ("\n", None)],
+        )
+        self.assertEqual([text for text, _ in h.iter_range(1, 5)], ["nt", " ", "a"])
+
+        self.assertEqual(h.line_range(4, 9), (24, len(code)))
+        for first, last in [(0, 1), (3, 2)]:
+            with self.assertRaises(ValueError):
+                h.line_range(first, last)
+
+        # Replacing the tokens invalidates the index
+        h.tokens = tokens[3:]
+        self.assertIsNone(h.token_at(2))
+
+    def test_html_embed(self):
+        link = Link(
+            file=Path("/usr/include/a.h"),
+            line=3,
+            column=1,
+            name="f",
+            qualified_name="f",
+            parameter_types=None,
+            cppref=None,
+        )
+        code = b"f(a <b)"
+        tokens = [
+            Token(offset=0, length=1, type=TokenType.NAME, link=link),
+            Token(offset=1, length=1, type=TokenType.PUNCTUATION),
+            Token(offset=2, length=1, type=TokenType.NAME),
+            Token(offset=4, length=1, type=TokenType.OPERATOR),
+            # Same declaration, but resolved to a cppreference page
+            Token(
+                offset=5,
+                length=1,
+                type=TokenType.NAME,
+                link=dataclasses.replace(link, cppref="cpp/f"),
+            ),
+            Token(offset=6, length=1, type=TokenType.PUNCTUATION),
+        ]
+        h = HighlightedCode(filename=None, code=code, tokens=tokens, diagnostics="")
+
+        out = io.StringIO()
+        output.html_embed(h, out)
+        self.assertEqual(
+            out.getvalue(),
+            '<pre class="m-code">'
+            '<span class="n"><a href="/usr/include/a.h#L3">f</a></span>'
+            '<span class="p">(</span>'
+            '<span class="n">a</span> '
+            '<span class="o">&lt;</span>'
+            '<span class="n"><a href="https://en.cppreference.com/w/cpp/f">b</a>'
+            "</span>"
+            '<span class="p">)</span></pre>',
+        )
+
+    # Timing-based, so it is only run on request
+    @unittest.skipUnless(os.environ.get("CH_BENCHMARK"), "set CH_BENCHMARK=1")
+    def test_decode_benchmark(self):
+        # Synthetic output of a large file
+        tokens = []
+        for i in range(100_000):
+            d = {"offset": 4 * i, "length": 3, "type": "name"}
+            if i % 3 == 0:
+                d["link"] = {
+                    "file": f"/usr/include/header{i % 7}.h",
+                    "line": i % 100,
+                    "column": 5,
+                    "name": "f",
+                    "qualified_name": "ns::f",
+                    "parameter_types": ["int"],
+                }
+            tokens.append(d)
+        raw = json.dumps({"file": "/tmp/large.cpp", "tokens": tokens}).encode()
+
+        def best_of_3(f):
+            times = []
+            for _ in range(3):
+                start = time.perf_counter()
+                result = f()
+                times.append(time.perf_counter() - start)
+            return result, min(times)
+
+        _, parsing = best_of_3(lambda: json.loads(raw))
+        h, decoding = best_of_3(
+            lambda: clang_highlight._decode(
+                raw, filename=None, code=b"", diagnostics="", cppref=False
+            )
+        )
+
+        # Building the tokens takes about as long as parsing the JSON (twice in
+        # total). Per-token overhead like dacite's would exceed this bound.
+        self.assertLess(decoding, 5 * parsing)
+
+        self.assertEqual(len(h.tokens), 100_000)
+        self.assertEqual(h.tokens[3].type, TokenType.NAME)
+        self.assertEqual(h.tokens[3].link.file, Path("/usr/include/header3.h"))
+        self.assertEqual(h.tokens[3].link.parameter_types, ["int"])
+        self.assertIsNone(h.tokens[4].link)
+
+        # Identical links are shared
+        self.assertIs(h.tokens[0].link, h.tokens[0 + 3 * 700].link)
+
+    def test_run_many(self):
+        codes = [
+            "struct A {};\nint main() { A a; }\n",
+            "int f(int x) { return x; }\nint g() { return f(1); }\n",
+            "int h() { return 0; }\n",
+        ]
+
+        results = list(clang_highlight.run_many(codes=codes, jobs=2))
+        self.assertEqual(len(results), len(codes))
+
+        by_code = {h.code.decode(): h for h in results}
+        self.assertEqual(set(by_code), set(codes))
+
+        _, tok = self.get_token(by_code[codes[1]], "f(1)")
+        self.assertEqual(tok.link.qualified_name, "f")
+
+    def test_run_many_abandoned(self):
+        # Workers cannot finish within the deadline, so each one sends the
+        # lexical result and exits. The supervisor has to start new ones.
+        codes = [
+            f"#include <map>\nint f{i}() {{ return std::map<int, int>{{}}.size(); }}\n"
+            for i in range(6)
+        ]
+
+        results = list(clang_highlight.run_many(codes=codes, jobs=2, deadline_ms=1))
+        self.assertEqual(sorted(h.code.decode() for h in results), sorted(codes))
+        self.assertTrue(all(h.degraded for h in results))
+
+        for h in results:
+            _, tok = self.get_token(h, "return")
+            self.assertEqual(tok.type, TokenType.KEYWORD)
+
+    def test_run_many_single_failure(self):
+        missing = Path("/nonexistent/missing.cpp")
+
+        # Not batch mode, but errors are handled the same way
+        results = clang_highlight.run_many([missing], skip_errors=True)
+        self.assertEqual(list(results), [])
+        with self.assertRaises(RuntimeError):
+            list(clang_highlight.run_many([missing]))
+
+        (h,) = clang_highlight.run_many(codes=["int f() { return 1; }\n"])
+        _, tok = self.get_token(h, "return")
+        self.assertEqual(tok.type, TokenType.KEYWORD)
+
+    def test_run_async(self):
+        codes = [f"int f{i}() {{ return {i}; }}\n" for i in range(4)]
+
+        async def highlight_all():
+            limit = asyncio.Semaphore(2)
+            return await asyncio.gather(
+                *(clang_highlight.run_async(code=c, limit=limit) for c in codes)
+            )
+
+        results = asyncio.run(highlight_all())
+        for code, h in zip(codes, results):
+            self.assertEqual(h.code.decode(), code)
+            _, tok = self.get_token(h, "int")
+            self.assertEqual(tok.type, TokenType.KEYWORD)
+
+    def test_archive(self):
+        codes = {
+            "a.cpp": "struct A {};\nint main() { A a; }\n",
+            "b.cpp": "int f(int x) { return x; }\nint g() { return f(1); }\n",
+        }
+
+        with tempfile.TemporaryDirectory() as tmp:
+            tmp = Path(tmp)
+            for name, code in codes.items():
+                (tmp / name).write_text(code)
+
+            (tmp / "compile_commands.json").write_text(
+                json.dumps(
+                    [
+                        {
+                            "directory": str(tmp),
+                            "command": f"/usr/bin/c++ -std=c++23 {name}",
+                            "file": name,
+                        }
+                        for name in codes
+                    ]
+                )
+            )
+
+            archive_path = tmp / "out.charchive"
+            subprocess.run(
+                [
+                    clang_highlight._ch,
+                    "-p",
+                    tmp,
+                    "--jobs=2",
+                    f"--archive={archive_path}",
+                    tmp / "a.cpp",
+                    tmp / "b.cpp",
+                ],
+                check=True,
+                stdout=subprocess.DEVNULL,
+            )
+
+            with clang_highlight.Archive(archive_path) as archive:
+                self.assertEqual(len(archive), 2)
+                self.assertIn(tmp / "b.cpp", archive)
+                self.assertNotIn(tmp / "c.cpp", archive)
+
+                h = archive.load(tmp / "b.cpp")
+                _, tok = self.get_token(h, "f(1)")
+                self.assertEqual(tok.link.qualified_name, "f")
+
+            # Through run_many(), results are matched to their inputs although
+            # the database names the files relative to its directory
+            results = clang_highlight.run_many(
+                [tmp / name for name in codes], build_dir=tmp, jobs=2
+            )
+            by_file = {h.filename: h for h in results}
+            self.assertEqual(set(by_file), {tmp / name for name in codes})
+            for name, code in codes.items():
+                self.assertEqual(by_file[tmp / name].code.decode(), code)
+
+    def test_compdb_index(self):
+        code = """
+        int f() { return 1; }
+        int g() { return 2; }
+        #if VALUE == 1
+        int x = f();
+        #else
+        int x = g();
+        #endif
+        """
+
+        with tempfile.TemporaryDirectory() as tmp:
+            tmp = Path(tmp)
+            (tmp / "main.cpp").write_text(code)
+            db = tmp / "compile_commands.json"
+            index = tmp / "compile_commands.json.chidx"
+
+            def write_db(value):
+                # Large enough to be indexed
+                entries = [
+                    {
+                        "directory": str(tmp),
+                        "command": f"/usr/bin/c++ -DFILE={i} -c file{i}.cpp",
+                        "file": f"file{i}.cpp",
+                    }
+                    for i in range(20000)
+                ]
+                entries.insert(
+                    12345,
+                    {
+                        "directory": str(tmp),
+                        "arguments": ["/usr/bin/c++", f"-DVALUE={value}"]
+                        + ["-c", "main.cpp"],
+                        "file": "main.cpp",
+                    },
+                )
+                db.write_text(json.dumps(entries))
+
+            def linked():
+                h = clang_highlight.run(filename=tmp / "main.cpp", build_dir=tmp)
+                self.assertEqual(h.diagnostics, "")
+                tokens = [self.get_token(h, f"{name}();")[1] for name in "fg"]
+                return [tok.link.name for tok in tokens if tok and tok.link]
+
+            write_db(1)
+            self.assertEqual(linked(), ["f"])
+            self.assertTrue(index.exists())
+
+            # Break the rest of the JSON without changing its size or mtime:
+            # the index is still current, so only the entry of main.cpp is read
+            stat = db.stat()
+            broken = db.read_bytes()
+            broken = broken[:1] + b"}" + broken[2:]
+            db.write_bytes(broken)
+            os.utime(db, ns=(stat.st_atime_ns, stat.st_mtime_ns))
+            self.assertEqual(linked(), ["f"])
+
+            # A changed database is indexed again
+            old_index = index.read_bytes()
+            write_db(10)
+            self.assertEqual(linked(), ["g"])
+            self.assertNotEqual(index.read_bytes(), old_index)
+
+    def test_configurations(self):
+        code = """
+        int f(int x) { return x; }
+        int g(int x) { return x; }
+        #ifdef USE_F
+        int h() { return f(1); }
+        #else
+        int h() { return g(1); }
+        #endif
+        """
+
+        with tempfile.TemporaryDirectory() as tmp:
+            tmp = Path(tmp)
+            (tmp / "main.cpp").write_text(code)
+            (tmp / "compile_commands.json").write_text(
+                json.dumps(
+                    [
+                        {
+                            "directory": str(tmp),
+                            "command": f"/usr/bin/c++ -std=c++23 {flags} main.cpp",
+                            "file": "main.cpp",
+                        }
+                        for flags in ("-DUSE_F", "")
+                    ]
+                )
+            )
+
+            h = clang_highlight.run(
+                filename=tmp / "main.cpp", build_dir=tmp, all_configs=True
+            )
+
+        self.assertEqual(len(h.configurations), 2)
+        self.assertIn("-DUSE_F", h.configurations[0])
+
+        # Active in the first configuration only
+        _, tok = self.get_token(h, "f(1)")
+        self.assertEqual(tok.link.qualified_name, "f")
+        self.assertEqual([v.configuration for v in tok.variants], [1])
+        self.assertIsNone(tok.variants[0].link)
+
+        # Active in the second configuration only
+        _, tok = self.get_token(h, "g(1)")
+        self.assertEqual(tok.link.qualified_name, "g")
+        self.assertEqual([v.configuration for v in tok.variants], [0])
+
+        # Same in both
+        _, tok = self.get_token(h, "g(int x)")
+        self.assertIsNone(tok.variants)
+
+    def test_configurations_lexing(self):
+        code = """
+        #define HEADER <cstddef>
+        #ifdef __cpp_char8_t
+        char8_t c = 0;
+        #include HEADER
+        #endif
+        int main() { return 0; }
+        """
+
+        with tempfile.TemporaryDirectory() as tmp:
+            tmp = Path(tmp)
+            (tmp / "main.cpp").write_text(code)
+            (tmp / "compile_commands.json").write_text(
+                json.dumps(
+                    [
+                        {
+                            "directory": str(tmp),
+                            "command": f"/usr/bin/c++ -std=c++17 {flags} main.cpp",
+                            "file": "main.cpp",
+                        }
+                        for flags in ("", "-fchar8_t")
+                    ]
+                )
+            )
+
+            h = clang_highlight.run(
+                filename=tmp / "main.cpp",
+                build_dir=tmp,
+                all_configs=True,
+                keep_going=True,
+            )
+
+        # Same standard, but only a keyword with -fchar8_t
+        _, tok = self.get_token(h, "char8_t c")
+        self.assertEqual(tok.type, TokenType.NAME)
+        self.assertEqual(
+            [(v.configuration, v.type) for v in tok.variants],
+            [(1, TokenType.KEYWORD)],
+        )
+
+        # The include is only active in the second configuration
+        self.assertEqual(
+            [(m.kind, m.configuration) for m in h.mismatches],
+            [("PreprocessedEntity", 1)],
+        )
+
 
 if __name__ == "__main__":
     unittest.main()